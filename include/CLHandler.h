@@ -9,14 +9,18 @@ cl_device_id
 CLGetDevice(cl_platform_id platform);
 cl_context
 CLCreateContext(cl_platform_id platform, cl_device_id device);
+/* Build the program in 'filename' with the compiler options 'options'. */
 cl_program
-CLBuildProgram(const char *filename, cl_context context, cl_device_id device);
+CLBuildProgram(const char *filename,
+        const char *options,
+        cl_context context,
+        cl_device_id device);
 cl_command_queue
 CLCreateQueue(cl_context context, cl_device_id device);
 cl_kernel
 CLCreateKernel(const char *kernel_name, cl_program program);
 cl_mem
-CLCreateBuffer(cl_context context, size_t size);
+CLCreateBuffer(cl_context context, cl_mem_flags flags, size_t size);
 void
 CLEnqueueKernel(cl_uint dim,
         size_t *global_size,
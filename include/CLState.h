@@ -9,9 +9,13 @@
 #include "matrix.h"
 #include "object.h"
 #include "kd_tree.h"
+#include "model.h"
+#include "render.h"
 
 void
-CLInit(const char *kernel_filename, const char *kernel_name);
+CLInit(const char *kernel_filename,
+        const char *kernel_name,
+        const render_config *render);
 void
 CLTerminate(void);
 void
@@ -19,7 +23,9 @@ CLSetCameraMatrix(Matrix matrix);
 void
 CLSetObjects(Object *vec_objects, size_t size);
 void
-CLSetMeshes(kd *models);
+CLSetMeshes(kd *models, const Instance *instances);
+void
+CLUpdateMesh(int model, const Vector4 *verts, const kd_config *config);
 void
 CLDeleteImage(void);
 void
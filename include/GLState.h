@@ -4,9 +4,13 @@
 #include "matrix.h"
 #include "object.h"
 #include "kd_tree.h"
+#include "model.h"
+#include "render.h"
 
 void
-GLInit(const char *kernel_filename, const char *kernel_name);
+GLInit(const char *kernel_filename,
+        const char *kernel_name,
+        const render_config *render);
 void
 GLGetWindowPos(int *x, int *y);
 void
@@ -16,7 +20,9 @@ GLSetCameraMatrix(Matrix matrix);
 void
 GLSetObjects(Object *vec_objects, size_t size);
 void
-GLSetMeshes(kd *models);
+GLSetMeshes(kd *models, const Instance *instances);
+void
+GLUpdateMesh(int model, const Vector4 *verts, const kd_config *config);
 void
 GLRegisterKey(int key, GLFWkeyfun function);
 void
@@ -0,0 +1,55 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "kd_tree.h"
+
+// The kernel walks the BVH with a fixed stack of BVH_STACK_SIZE entries,
+// which is enough for any tree no deeper than this.
+#define BVH_MAX_DEPTH 48
+
+/* 32-byte BVH node. A leaf has count > 0 and covers the triangles
+ * tri_indices[start .. start + count). An interior node has
+ * count = -1 - axis, where 'axis' is the axis it was split along, and its
+ * two children at start and start + 1.
+ */
+struct bvhnode {
+    cl_float min[3];
+    cl_int start;
+    cl_float max[3];
+    cl_int count;
+};
+
+/* Build a binned SAH BVH over 'tris'. Every triangle is referenced by
+ * exactly one leaf, so tri_indices is a permutation of the triangles. With
+ * no triangles, the tree has no nodes at all.
+ */
+kd
+build_bvh(cl_int4 *tris,
+        Vector3 *verts,
+        Vector3 *norms,
+        const kd_config *config);
+
+/* Recompute the bounds of every node of a BVH from its current vertices,
+ * keeping its topology. Returns the tree's SAH cost afterwards.
+ */
+vec_t
+refit_bvh(kd *tree, const kd_config *config);
+
+/* Update a BVH after its vertices have moved. The tree is refitted, or
+ * rebuilt from scratch if refitting degraded its SAH cost past
+ * config->refit_limit. Either way its records are recomputed. Returns 1 if
+ * the tree was rebuilt, in which case its node count and tri_indices may
+ * have changed, or 0 otherwise.
+ */
+int
+update_bvh(kd *tree, const kd_config *config);
+
+/* Build a BVH over 'count' boxes, such as whole models, splitting at the
+ * median centroid along the widest axis. Every leaf holds one box, and its
+ * 'start' is that box's index. With no boxes, the BVH is a single root with
+ * empty bounds, so there is always a root to read.
+ */
+bvhnode *
+build_tlas(const Vector3 *mins, const Vector3 *maxs, int count);
+
+#endif//BVH_H
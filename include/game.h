@@ -1,10 +1,14 @@
 #ifndef GAME_H
 #define GAME_H
 
+#include "model.h"
+#include "render.h"
+
 void
 GameInit(const char *kernel_filename,
         const char *kernel_name,
-        const char *const *models);
+        const ModelSpec *models,
+        const render_config *render);
 void
 StartGameLoop(void);
 void
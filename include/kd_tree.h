@@ -5,14 +5,48 @@
 
 typedef struct kd kd;
 typedef struct kdnode kdnode;
+typedef struct kdleaf kdleaf;
+typedef struct bvhnode bvhnode;
+typedef struct kdrecord kdrecord;
 typedef cl_int kd_index;
 
+typedef enum ACCEL_TYPE {
+    ACCEL_KD, ACCEL_BVH
+} ACCEL_TYPE;
+
+/* Triangles are the indices of their three vertices in s[0 .. 2], with
+ * KD_TRI_SMOOTH set in s[3] if all three have normals to interpolate.
+ * norm_vec is empty if no vertex has a normal, and otherwise parallel to
+ * vert_vec.
+ */
+#define KD_TRI_SMOOTH 1
+
+/* A mesh and its acceleration structure: either a kd-tree in node_vec and
+ * leaf_vec, or a BVH in bvh_vec, both indexing triangles through
+ * tri_indices, with the intersection record of each entry in record_vec.
+ * The unused structure's lists are empty. source_vec is parallel to
+ * vert_vec, holding the index of the parsed position each vertex was
+ * welded from, so that positions in the mesh file's order can be mapped
+ * onto the tree's vertices. 'sah_cost' is the SAH cost of a BVH when it
+ * was built, or 0 if unknown. A tree read by
+ * parse_kd() has its lists in place in 'mapping', a private mapping of the
+ * file, which must not be grown or freed; see kd_delete_list().
+ */
 struct kd {
+    ACCEL_TYPE accel;
     kdnode *node_vec;
+    kdleaf *leaf_vec;
+    bvhnode *bvh_vec;
     int *tri_indices;
+    kdrecord *record_vec;
     Vector4 *vert_vec;
     Vector4 *norm_vec;
-    cl_int3 *tri_vec;
+    int *source_vec;
+    cl_int4 *tri_vec;
+    Vector3 min, max;
+    vec_t sah_cost;
+    void *mapping;
+    size_t mapping_size;
 };
 
 typedef enum KD_AXIS {
@@ -28,32 +62,123 @@ typedef enum KD_SIDE {
     KD_FRONT = 5
 } KD_SIDE;
 
-#pragma pack(push, 1)
+typedef enum KD_BUILDER {
+    KD_BUILD_BINNED, KD_BUILD_SWEEP
+} KD_BUILDER;
+
+/* Parameters controlling how build_kd() constructs the tree.
+ * accel:   ACCEL_KD builds a roped kd-tree, ACCEL_BVH a binned SAH BVH
+ *          using 'bins', 'traverse_cost' and 'max_depth'.
+ * builder: KD_BUILD_BINNED histograms the triangle bounds into 'bins' equal
+ *          bins per axis and tests the planes between them,
+ *          KD_BUILD_SWEEP sorts the triangle bounds once and evaluates the
+ *          exact SAH at every candidate plane in O(N log N).
+ * bins:    number of bins per axis used by KD_BUILD_BINNED.
+ * clip:    if nonzero, split candidates and child membership use each
+ *          triangle clipped to the node instead of its full bounding box,
+ *          so large triangles stop landing in children they only reach
+ *          through empty corners of their box.
+ * traverse_cost: cost of visiting one interior node relative to one
+ *          ray-triangle intersection. A node is only split when the
+ *          expected cost of its children is below that of intersecting all
+ *          of its triangles, so higher values give shallower trees.
+ * empty_bonus: fraction of the cost discounted for splits that leave one
+ *          child empty, favouring planes that cut off empty space.
+ * max_depth: depth limit of the tree, or 0 for 8 + 1.3 log2(N) with N
+ *          triangles.
+ * refit_limit: a BVH whose bounds are refitted after its vertices move is
+ *          rebuilt once its SAH cost exceeds this multiple of its cost when
+ *          it was built.
+ * weld:    when a parsed mesh is indexed by weld_mesh(), vertices closer
+ *          than this are merged, or only identical ones if 0.
+ */
+typedef struct kd_config {
+    ACCEL_TYPE accel;
+    KD_BUILDER builder;
+    int bins;
+    int clip;
+    vec_t traverse_cost;
+    vec_t empty_bonus;
+    int max_depth;
+    vec_t refit_limit;
+    vec_t weld;
+} kd_config;
+
+#define KD_CONFIG_DEFAULT ((kd_config){ \
+        ACCEL_KD, KD_BUILD_BINNED, 32, 0, 0.75f, 0.2f, 0, 1.5f, 0 \
+})
+
+/* Nodes are 8 bytes: the split plane, and the split axis in the low two bits
+ * of 'data' with the index of the node's first child above them. The two
+ * children of a split are always stored next to each other. A node whose
+ * axis is KD_LEAF_AXIS is a leaf, and its index selects its record in the
+ * leaf table instead, which holds everything only leaves need.
+ */
+#define KD_LEAF_AXIS 3
+/* build_kd() clusters nodes into cache lines of this many, counted from the
+ * start of node_vec, so copies of it should start on a multiple of it too.
+ */
+#define KD_BLOCK_NODES 8
+#define KD_NODE_AXIS(node) ((node).data & 3)
+#define KD_NODE_INDEX(node) ((kd_index)((node).data >> 2))
+
 struct kdnode {
-    Vector4 min, max;
-    enum {
-        KD_SPLIT, KD_LEAF
-    } type;
-    union {
-        struct {
-            vec_t value;
-            KD_AXIS axis;
-            kd_index children[2];
-        } split;
-        struct {
-            kd_index tris;
-            kd_index tri_count;
-            kd_index ropes[6];
-        } leaf;
-    };
+    cl_float value;
+    cl_uint data;
+};
+
+/* Bounds, ropes (the node beyond each face, or -1) and triangle range of a
+ * leaf, 64 bytes.
+ */
+struct kdleaf {
+    Vector3 min, max;
+    kd_index tris;
+    kd_index tri_count;
+    kd_index ropes[6];
+};
+
+/* What the kernel needs to intersect one entry of tri_indices, so that a
+ * leaf's triangles are read as one contiguous run: the triangle's first
+ * vertex, with the triangle's index in the bits of its w, and its two edges
+ * from that vertex. Shading data is only looked up through the index.
+ */
+struct kdrecord {
+    Vector4 v0;
+    Vector4 e1, e2;
 };
-#pragma pack(pop)
 
+/* Build the acceleration structure selected by 'config' over a mesh indexed
+ * by weld_mesh(), taking ownership of its lists, and save it to 'path' as a
+ * .kd file unless 'path' is NULL. Triangles are renumbered in the order
+ * the tree's leaves use them, and so are a kd-tree's vertices; a BVH keeps
+ * weld_mesh()'s vertex order so that its vertices can be updated.
+ * 'sources' becomes the tree's source_vec. A mesh with no triangles gives a
+ * tree with no nodes, which is not saved.
+ */
 kd
-build_kd(cl_int3 *tris, Vector3 *verts, Vector3 *norms, const char *path);
+build_kd(cl_int4 *tris,
+        Vector3 *verts,
+        Vector3 *norms,
+        int *sources,
+        const kd_config *config,
+        const char *path);
 
+/* Map a .kd file written by build_kd() and use its sections in place. Returns
+ * 0 on success, or 1 if the file can't be read, is from another version,
+ * or is corrupt. Only the header and the sections' sizes and bounds are
+ * checked, unless 'verify' is nonzero, in which case every section is read
+ * and checked against the checksum it was written with.
+ */
 int
-parse_kd(const char *filename, kd *tree);
+parse_kd(const char *filename, kd *tree, int verify);
+
+/* Recompute record_vec from the tree's current vertices and tri_indices. */
+void
+kd_update_records(kd *tree);
+
+/* Free one of 'tree's lists, unless it lives in the tree's mapping. */
+void
+kd_delete_list(const kd *tree, void *list);
 
 void
 delete_kd(kd tree);
@@ -3,7 +3,8 @@
 
 #include <stddef.h>
 
-extern size_t LIST_INDEX;
+// Thread-local so that threads may append to different vectors at once.
+extern _Thread_local size_t LIST_INDEX;
 
 /* Add 'item' to the end of the vector, resizing if necessary. Note: the
  * vector must be defined as a pointer to 'item's type, to allow for proper
@@ -13,8 +14,13 @@ extern size_t LIST_INDEX;
         LIST_INDEX = list_grow((void**)&(vec), sizeof((item))), \
         (vec)[LIST_INDEX] = (item) \
     )
+// Bytes a list keeps in front of its data.
+#define LIST_HEADER_SIZE (2 * sizeof(size_t))
+
 #define vector_length(vec) (list_size(vec) / sizeof(*vec))
-#define vector_concat(v1, v2) vec_concat((void**)&v1, v2)
+#define vector_concat(v1, v2) list_concat((void**)&(v1), v2)
+#define vector_resize(vec, count) \
+    list_resize((void**)&(vec), (count) * sizeof(*(vec)))
 void
 list_concat(void **list1_ptr, const void *list2);
 void *
@@ -23,6 +29,12 @@ void *
 init_list(size_t count, size_t size);
 void *
 copy_list(const void *);
+/* Use the 'size' bytes at 'buffer' as a list in place, writing the list's
+ * header over the LIST_HEADER_SIZE bytes before 'buffer'. The memory is not
+ * the list's own, so the list must not be grown or deleted.
+ */
+void *
+wrap_list(void *buffer, size_t size);
 void
 delete_list(void *);
 /* Add 'size' to the vector's length, reallocating if necessary. Returns the
@@ -33,5 +45,10 @@ size_t
 list_grow(void **list_ptr, size_t size);
 size_t
 list_size(const void *);
+/* Set the vector's length to 'size' bytes, reallocating if it grows past its
+ * capacity. New space is left uninitialized.
+ */
+void
+list_resize(void **list_ptr, size_t size);
 
 #endif//LIST_H
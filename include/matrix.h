@@ -23,6 +23,12 @@ struct Matrix {
            {{ m30, m31, m32, m33 }} \
         } }
 
+#define Matrix_identity Matrix( \
+        1, 0, 0, 0, \
+        0, 1, 0, 0, \
+        0, 0, 1, 0, \
+        0, 0, 0, 1)
+
 void
 mat_set(Matrix *, unsigned int n, unsigned int m, vec_t value);
 vec_t
@@ -37,5 +43,14 @@ Matrix *
 mat_scale(Matrix *, vec_t);
 Matrix
 mat_inverse(Matrix, int *err);
+Matrix
+mat_translation(Vector3);
+Matrix
+mat_scaling(vec_t);
+Matrix
+mat_rotation_y(vec_t radians);
+/* Apply 'mat' to the point 'v', including the homogeneous divide. */
+Vector3
+mat_transform_point(Matrix mat, Vector3 v);
 
 #endif//MATRIX_H
@@ -2,8 +2,53 @@
 #define MODEL_H
 
 #include "kd_tree.h"
+#include "matrix.h"
+
+typedef struct ModelSpec ModelSpec;
+typedef struct Instance Instance;
+
+/* A model to place in the scene. If 'deform' is nonzero, a ripple that
+ * high, as a fraction of the model's size, moves through its vertices every
+ * frame; only BVH models can be deformed. Specs naming the same file with
+ * the same config and deformation share one loaded copy of it.
+ */
+struct ModelSpec {
+    const char *filename;
+    kd_config config;
+    Matrix transform;
+    vec_t deform;
+};
+
+/* One placement of a loaded model, transformed from model to world space
+ * by 'transform'.
+ */
+struct Instance {
+    int model;
+    Matrix transform;
+};
+
+/* Use 'dir' to cache the trees built for OBJ and PLY files, keyed by a hash
+ * of the file's contents and the build config, or disable caching if 'dir'
+ * is NULL. Defaults to ".kdcache".
+ */
+void
+SetModelCache(const char *dir);
+
+/* Read OBJ files 'block_size' bytes at a time instead of mapping them, so
+ * the text is never held in memory all at once, or map them again if
+ * 'block_size' is 0.
+ */
+void
+SetModelStreaming(size_t block_size);
+
+/* Check every section of a .kd file against its checksum when loading it,
+ * if 'verify' is nonzero, instead of only its header and section table.
+ * Off by default, since it reads the whole file.
+ */
+void
+SetCacheVerification(int verify);
 
 int
-LoadModel(const char *filename, kd *model);
+LoadModel(const char *filename, const kd_config *config, kd *model);
 
 #endif//MODEL_H
@@ -0,0 +1,49 @@
+#ifndef OBJ_H
+#define OBJ_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "util.h"
+#include "vector.h"
+
+/* Sizes of the lists parsing an OBJ file produces. */
+typedef struct obj_counts {
+    size_t verts;
+    size_t norms;
+    size_t corners;
+} obj_counts;
+
+/* Parse the OBJ text data[0 .. len) into new lists of vertex positions,
+ * normals and triangles. Polygons are triangulated as fans, and each
+ * triangle is three corners of (position, normal, texcoord) indices, with
+ * -1 for a missing normal or texcoord. The text is split at line boundaries
+ * into chunks parsed as separate pool tasks. Returns 0 on success, or 1 if
+ * a line is malformed, in which case no lists are returned.
+ */
+int
+parse_obj(const char *data,
+        size_t len,
+        Vector3 **verts,
+        Vector3 **norms,
+        cl_int3 **tris);
+
+/* Read an OBJ file 'block_size' bytes at a time and count the elements it
+ * defines, feeding every byte to 'hash' too unless it is NULL.
+ */
+int
+scan_obj(FILE *file, size_t block_size, hash_state *hash, obj_counts *counts);
+
+/* Parse an OBJ file like parse_obj(), but reading it 'block_size' bytes at
+ * a time and appending straight to lists sized by 'counts' from scan_obj().
+ * Apart from the final lists, memory use is bounded by one block.
+ */
+int
+stream_obj(FILE *file,
+        size_t block_size,
+        const obj_counts *counts,
+        Vector3 **verts,
+        Vector3 **norms,
+        cl_int3 **tris);
+
+#endif//OBJ_H
@@ -0,0 +1,24 @@
+#ifndef PLY_H
+#define PLY_H
+
+#include <stddef.h>
+
+#include "vector.h"
+
+/* Parse the binary PLY data[0 .. len) into new lists of vertex positions,
+ * normals and triangles, in the same form as parse_obj(). Positions come
+ * from the x, y and z properties of the "vertex" element, and normals from
+ * nx, ny and nz if it has them, so each corner's normal index is its vertex
+ * index or -1. Faces are read from the "vertex_indices" list of the "face"
+ * element and triangulated as fans. Other elements and properties are
+ * skipped. Returns 0 on success, or 1 if the file is malformed or not
+ * binary, in which case no lists are returned.
+ */
+int
+parse_ply(const char *data,
+        size_t len,
+        Vector3 **verts,
+        Vector3 **norms,
+        cl_int3 **tris);
+
+#endif//PLY_H
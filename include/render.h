@@ -0,0 +1,29 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+/* Options for how the scene is stored on the device and rendered, fixed
+ * when the kernel is built.
+ * compress: store vertex positions as packed float3s and normals as 32-bit
+ *           octahedral encodings instead of 16-byte vectors, halving the
+ *           memory and bandwidth used by vertices.
+ * mailbox:  if nonzero, remember this many of the triangles a ray last
+ *           tested in a kd-tree, and skip testing them again in later
+ *           leaves.
+ * stats:    count triangle tests and the tests the mailbox skipped, and
+ *           print them every STATS_FRAMES frames.
+ * wavefront: render with the separate generate, extend and shade kernels
+ *           instead of the single render kernel.
+ * max_depth: the most segments a path may have, counting the camera ray.
+ */
+typedef struct render_config {
+    int compress;
+    int mailbox;
+    int stats;
+    int wavefront;
+    int max_depth;
+} render_config;
+
+#define RENDER_CONFIG_DEFAULT ((render_config){ 0, 0, 0, 0, 4 })
+#define STATS_FRAMES 60
+
+#endif//RENDER_H
@@ -0,0 +1,43 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+typedef struct task_group task_group;
+
+/* A set of tasks that can be waited on together. Initialize with
+ * TASK_GROUP_INIT before submitting anything to it.
+ */
+struct task_group {
+    int pending;
+};
+
+#define TASK_GROUP_INIT ((task_group){ 0 })
+
+/* Start the pool with 'threads' threads in total, counting the calling
+ * thread. A value of 0 uses one thread per online processor. Calling this is
+ * optional; the first pool_submit() starts a default-sized pool. Returns 0
+ * on success, or 1 if the pool had already started, keeping its size.
+ */
+int
+pool_init(int threads);
+void
+pool_terminate(void);
+/* Number of threads that can run tasks, including the calling thread. */
+int
+pool_size(void);
+/* 0 on threads outside the pool, 1..pool_size()-1 on the pool's workers. Use
+ * it to index per-thread scratch memory of pool_size() entries.
+ */
+int
+pool_thread_index(void);
+/* Queue func(arg) as part of 'group'. With a single-threaded pool the task
+ * runs immediately.
+ */
+void
+pool_submit(task_group *group, void (*func)(void *), void *arg);
+/* Block until every task in 'group' has finished. While waiting, the caller
+ * runs any of the group's tasks that no worker has picked up yet.
+ */
+void
+pool_wait(task_group *group);
+
+#endif//THREAD_POOL_H
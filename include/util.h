@@ -1,9 +1,75 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <stdint.h>
+#include <stdio.h>
+
 char *
 safe_strdup(const char *s);
 
 #define strdup(s) safe_strdup(s)
 
+/* Milliseconds of wall time since an arbitrary fixed point. Unlike clock(),
+ * this does not add up the CPU time of every thread.
+ */
+long
+wall_clock_ms(void);
+
+/* Map all of 'filename' into memory and store its length in 'size'. The
+ * mapping is private and copy-on-write, so it can be modified without
+ * touching the file, and pages are only read in once they are used.
+ * Returns NULL on failure.
+ */
+void *
+map_file(const char *filename, size_t *size);
+
+void
+unmap_file(void *data, size_t size);
+
+/* FNV-1a style hash over 8-byte words in four independent lanes, so the
+ * multiplies overlap and hashing keeps up with reading from disk. Data can
+ * be fed in pieces of any size with hash_update(), giving the same result
+ * as hashing it all at once with hash_data(). Different seeds give
+ * unrelated hashes of the same data.
+ */
+typedef struct hash_state {
+    uint64_t lanes[4];
+    unsigned char pending[32];
+    size_t pending_len;
+} hash_state;
+
+void
+hash_init(hash_state *state, uint64_t seed);
+void
+hash_update(hash_state *state, const void *data, size_t size);
+uint64_t
+hash_final(const hash_state *state);
+uint64_t
+hash_data(const void *data, size_t size, uint64_t seed);
+
+/* Largest resident set size of the process so far, in megabytes. */
+long
+peak_rss_mb(void);
+
+/* Create the directory 'path' unless it already exists. Returns 0 on
+ * success.
+ */
+int
+make_directory(const char *path);
+
+/* Open a new, uniquely named file next to 'path' for writing in its place,
+ * storing its name in 'temp_path', which the caller frees. Returns NULL on
+ * failure.
+ */
+FILE *
+create_temp_file(const char *path, char **temp_path);
+
+/* Close 'file', a temporary file from create_temp_file(), and rename it to
+ * 'path' in one step, so readers of 'path' see either its old contents or
+ * all of the new ones. On failure the temporary file is removed. Returns 0
+ * on success.
+ */
+int
+publish_file(FILE *file, const char *temp_path, const char *path);
+
 #endif//UTIL_H
@@ -0,0 +1,26 @@
+#ifndef WELD_H
+#define WELD_H
+
+#include "vector.h"
+
+/* Convert the corners of a parsed mesh, which index positions, normals and
+ * texcoords separately, into triangles indexing one space of vertices
+ * shared by positions and normals, as build_kd() expects. Each distinct
+ * pair of position and normal used by a corner becomes one vertex, numbered
+ * in order of first use, so attributes no triangle references are dropped.
+ * Positions within 'tolerance' of an earlier one are welded to it, and
+ * identical normals are merged; with no tolerance only identical positions
+ * are merged. Triangles left with two corners at the same position are
+ * removed. 'corners' is freed, and 'verts' and 'norms' are replaced by the
+ * welded vertices' attributes. '*sources' is set to a new list holding, for
+ * each welded vertex, the index of the parsed position it was taken from,
+ * which is the first of any positions welded together.
+ */
+cl_int4 *
+weld_mesh(cl_int3 *corners,
+        Vector3 **verts,
+        Vector3 **norms,
+        int **sources,
+        vec_t tolerance);
+
+#endif//WELD_H
@@ -215,7 +215,10 @@ CLCreateContext(cl_platform_id platform, cl_device_id device) {
 }
 
 cl_program
-CLBuildProgram(const char *filename, cl_context context, cl_device_id device) {
+CLBuildProgram(const char *filename,
+        const char *options,
+        cl_context context,
+        cl_device_id device) {
     cl_program program;
     FILE *file;
     size_t length;
@@ -237,7 +240,7 @@ CLBuildProgram(const char *filename, cl_context context, cl_device_id device) {
             &err);
     HANDLE_ERR(err);
     free(src);
-    err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
+    err = clBuildProgram(program, 0, NULL, options, NULL, NULL);
     if (err < 0) {
         HANDLE_ERR(clGetProgramBuildInfo(program,
                 device,
@@ -280,11 +283,11 @@ CLCreateKernel(const char *kernel_name, cl_program program) {
 }
 
 cl_mem
-CLCreateBuffer(cl_context context, size_t size) {
+CLCreateBuffer(cl_context context, cl_mem_flags flags, size_t size) {
     cl_mem buffer;
     cl_int err;
 
-    buffer = clCreateBuffer(context, CL_MEM_READ_ONLY, size, NULL, &err);
+    buffer = clCreateBuffer(context, flags, size, NULL, &err);
     HANDLE_ERR(err);
     return buffer;
 }
@@ -1,5 +1,8 @@
 #include <CL/cl_gl.h>
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <GL/gl3w.h>
 #include <GLFW/glfw3.h>
 
@@ -9,6 +12,9 @@
 #include "object.h"
 #include "list.h"
 #include "kd_tree.h"
+#include "bvh.h"
+#include "model.h"
+#include "render.h"
 
 typedef struct KernelArg {
     size_t size;
@@ -18,6 +24,42 @@ typedef struct KernelArg {
 
 #define KernelArg(size, arg_ptr, is_ptr) ((KernelArg){ size, arg_ptr, is_ptr })
 
+/* Where one model's data starts in the scene's concatenated buffers, and
+ * the model's bounds. Mirrors MeshDesc in kernel.cl.
+ */
+typedef struct MeshDesc {
+    Vector3 min, max;
+    cl_int accel;
+    cl_int verts, norms, tris, records, kd_nodes, kd_leaves, bvh;
+} MeshDesc;
+
+/* One placement of a mesh. Rays are moved into the mesh's own space rather
+ * than the mesh into the world, so every instance of a mesh shares its one
+ * copy of the geometry. Mirrors InstanceDesc in kernel.cl.
+ */
+typedef struct InstanceDesc {
+    Matrix world_to_object;
+    cl_int mesh;
+} InstanceDesc;
+
+/* A path waiting in the wavefront ray queue, and a queued ray's hit. Only
+ * their sizes matter here. Mirror PathRay and PathHit in kernel.cl.
+ */
+typedef struct PathRay {
+    cl_float4 orig, dir;
+    cl_float4 radiance, throughput;
+    cl_int pixel;
+    cl_int depth;
+    cl_uint seed;
+} PathRay;
+
+typedef struct PathHit {
+    cl_float dist;
+    cl_int instance, mesh, tri;
+    cl_float2 uv;
+    cl_int ray;
+} PathHit;
+
 static struct {
     cl_platform_id platform;
     cl_device_id device;
@@ -25,18 +67,48 @@ static struct {
     cl_program program;
     cl_command_queue queue;
     cl_kernel kernel;
+    cl_kernel generate;
+    cl_kernel extend;
+    cl_kernel shade;
+    cl_kernel tonemap;
+    render_config render;
     cl_mem image;
     cl_mem matrix;
     cl_mem objects;
     cl_int objcount;
-    kd kd;
+    kd *models;
+    Instance *instance_vec;
+    MeshDesc *mesh_descs;
+    size_t bvh_len;
     cl_mem verts;
     cl_mem norms;
     cl_mem tris;
-    cl_mem triIndices;
+    cl_mem records;
     cl_mem kdtree;
+    cl_mem kdleaves;
+    cl_mem bvh;
+    cl_mem meshes;
+    cl_mem instances;
+    cl_mem tlas;
+    cl_mem stats;
+    cl_uint stats_total[2];
+    int stats_frames;
+    cl_mem rays;
+    cl_mem next_rays;
+    cl_mem hits;
+    cl_mem counts;
+    size_t wave_size;
+    cl_mem accum;
+    cl_mem rng;
+    cl_uint samples;
+    Matrix camera;
+    int frame_width, frame_height;
     size_t treesize;
     KernelArg *vec_args;
+    KernelArg *generate_args;
+    KernelArg *extend_args;
+    KernelArg *shade_args;
+    KernelArg *tonemap_args;
 } State;
 
 void
@@ -67,6 +139,11 @@ long long unsigned int count = 0;
 void
 CLSetCameraMatrix(Matrix matrix) {
     count++;
+    // Samples only add up while the camera holds still.
+    if (memcmp(&matrix, &State.camera, sizeof(matrix)) != 0) {
+        State.camera = matrix;
+        State.samples = 0;
+    }
     HANDLE_ERR(clEnqueueWriteBuffer(State.queue,
             State.matrix,
             CL_TRUE,
@@ -79,18 +156,15 @@ CLSetCameraMatrix(Matrix matrix) {
 }
 
 static void
-update_args(cl_kernel kernel) {
-    size_t count = vector_length(State.vec_args);
+update_args(cl_kernel kernel, const KernelArg *args) {
+    size_t count = vector_length(args);
     for (size_t i = 0; i < count; i++) {
-        HANDLE_ERR(clSetKernelArg(kernel,
-                i,
-                State.vec_args[i].size,
-                State.vec_args[i].arg_ptr));
+        HANDLE_ERR(clSetKernelArg(kernel, i, args[i].size, args[i].arg_ptr));
     }
 }
 
 static void
-resize_buffer(cl_mem *buffer, size_t size) {
+resize_buffer_flags(cl_mem *buffer, cl_mem_flags flags, size_t size) {
     if (*buffer != 0) {
         HANDLE_ERR(clReleaseMemObject(*buffer));
     }
@@ -98,7 +172,12 @@ resize_buffer(cl_mem *buffer, size_t size) {
         *buffer = 0;
         return;
     }
-    *buffer = CLCreateBuffer(State.context, size);
+    *buffer = CLCreateBuffer(State.context, flags, size);
+}
+
+static void
+resize_buffer(cl_mem *buffer, size_t size) {
+    resize_buffer_flags(buffer, CL_MEM_READ_ONLY, size);
 }
 
 void
@@ -121,83 +200,436 @@ CLSetObjects(Object *vec_objects, size_t size) {
             NULL));
 }
 
-void
-CLSetMeshes(kd *models) {
+static void
+upload_buffer(cl_mem *buffer, const void *list) {
+    size_t size = list_size(list);
+    resize_buffer(buffer, size);
+    if (size == 0) {
+        return;
+    }
+    HANDLE_ERR(clEnqueueWriteBuffer(State.queue,
+            *buffer,
+            CL_TRUE,
+            0,
+            size,
+            list,
+            0,
+            NULL,
+            NULL));
+}
+
+/* Bounds of the box 'min'..'max' after transforming it by 'mat'. */
+static void
+transform_bounds(Matrix mat, Vector3 *min, Vector3 *max) {
+    Vector3 lo = *min, hi = *max;
+    for (int i = 0; i < 8; i++) {
+        Vector3 corner = mat_transform_point(mat, Vector3(
+                i & 1 ? hi.s[0] : lo.s[0],
+                i & 2 ? hi.s[1] : lo.s[1],
+                i & 4 ? hi.s[2] : lo.s[2]));
+        *min = i == 0 ? corner : vec_min(*min, corner);
+        *max = i == 0 ? corner : vec_max(*max, corner);
+    }
+}
+
+/* Overwrite part of a buffer with 'list', starting 'offset' bytes in. */
+static void
+write_range(cl_mem buffer, size_t offset, const void *list) {
+    if (list_size(list) == 0) {
+        return;
+    }
+    HANDLE_ERR(clEnqueueWriteBuffer(State.queue,
+            buffer,
+            CL_TRUE,
+            offset,
+            list_size(list),
+            list,
+            0,
+            NULL,
+            NULL));
+}
+
+/* Octahedral encoding of a normal in two snorm16s, low half first: the
+ * normal is projected onto the octahedron |x| + |y| + |z| = 1, whose lower
+ * half is folded over the upper one. Decoded by oct_decode() in kernel.cl.
+ */
+static cl_uint
+oct_encode(Vector4 n) {
+    vec_t l1 = fabsf(n.s[0]) + fabsf(n.s[1]) + fabsf(n.s[2]);
+    if (l1 == 0) {
+        return 0;
+    }
+    vec_t x = n.s[0] / l1, y = n.s[1] / l1;
+    if (n.s[2] < 0) {
+        vec_t folded_x = (1 - fabsf(y)) * (x < 0 ? -1 : 1);
+        y = (1 - fabsf(x)) * (y < 0 ? -1 : 1);
+        x = folded_x;
+    }
+    cl_ushort ex = (cl_ushort)(cl_short)lroundf(x * 32767),
+            ey = (cl_ushort)(cl_short)lroundf(y * 32767);
+    return ex | (cl_uint)ey << 16;
+}
+
+/* Write a model's vertex positions into the device buffer, starting at
+ * vertex 'first', as packed float3s if compressing.
+ */
+static void
+write_verts(size_t first, const Vector4 *verts) {
+    if (!State.render.compress) {
+        write_range(State.verts, first * sizeof(*verts), verts);
+        return;
+    }
+    size_t count = vector_length(verts);
+    cl_float *packed = init_list(3 * count, sizeof(*packed));
+    for (size_t i = 0; i < count; i++) {
+        memcpy(&packed[3 * i], verts[i].s, 3 * sizeof(*packed));
+    }
+    write_range(State.verts, 3 * first * sizeof(*packed), packed);
+    delete_list(packed);
+}
+
+/* Write a model's normals like write_verts(), octahedral-encoded if
+ * compressing.
+ */
+static void
+write_norms(size_t first, const Vector4 *norms) {
+    if (!State.render.compress) {
+        write_range(State.norms, first * sizeof(*norms), norms);
+        return;
+    }
+    size_t count = vector_length(norms);
+    cl_uint *packed = init_list(count, sizeof(*packed));
+    for (size_t i = 0; i < count; i++) {
+        packed[i] = oct_encode(norms[i]);
+    }
+    write_range(State.norms, first * sizeof(*packed), packed);
+    delete_list(packed);
+}
+
+/* Lay every model's lists out one after another in shared buffers, located
+ * through the models' MeshDescs, and upload each list straight into its
+ * place, so lists mapped from .kd files are read once without being copied
+ * on the host.
+ */
+static void
+upload_geometry(void) {
+    kd *models = State.models;
     size_t model_count = vector_length(models);
-    if (model_count == 0) {
+    MeshDesc *meshes = new_list(model_count * sizeof(*meshes));
+    MeshDesc total = { 0 };
+    for (size_t i = 0; i < model_count; i++) {
+        kd *model = &models[i];
+        MeshDesc desc = total;
+        desc.min = model->min;
+        desc.max = model->max;
+        desc.accel = model->accel;
+        vector_append(meshes, desc);
+        total.verts += vector_length(model->vert_vec);
+        total.norms += vector_length(model->norm_vec);
+        total.tris += vector_length(model->tri_vec);
+        total.records += vector_length(model->record_vec);
+        total.kd_nodes += vector_length(model->node_vec);
+        // Start the next tree on a cache line, as its layout expects.
+        total.kd_nodes += -total.kd_nodes & (KD_BLOCK_NODES - 1);
+        total.kd_leaves += vector_length(model->leaf_vec);
+        total.bvh += vector_length(model->bvh_vec);
+    }
+    size_t vert_size = State.render.compress
+            ? 3 * sizeof(cl_float)
+            : sizeof(*models->vert_vec);
+    size_t norm_size = State.render.compress
+            ? sizeof(cl_uint)
+            : sizeof(*models->norm_vec);
+    resize_buffer(&State.verts, total.verts * vert_size);
+    resize_buffer(&State.norms, total.norms * norm_size);
+    resize_buffer(&State.tris, total.tris * sizeof(*models->tri_vec));
+    resize_buffer(&State.records,
+            total.records * sizeof(*models->record_vec));
+    resize_buffer(&State.kdtree, total.kd_nodes * sizeof(*models->node_vec));
+    resize_buffer(&State.kdleaves,
+            total.kd_leaves * sizeof(*models->leaf_vec));
+    resize_buffer(&State.bvh, total.bvh * sizeof(*models->bvh_vec));
+    for (size_t i = 0; i < model_count; i++) {
+        kd *model = &models[i];
+        MeshDesc *desc = &meshes[i];
+        write_verts(desc->verts, model->vert_vec);
+        write_norms(desc->norms, model->norm_vec);
+        write_range(State.tris,
+                desc->tris * sizeof(*model->tri_vec),
+                model->tri_vec);
+        write_range(State.records,
+                desc->records * sizeof(*model->record_vec),
+                model->record_vec);
+        write_range(State.kdtree,
+                desc->kd_nodes * sizeof(*model->node_vec),
+                model->node_vec);
+        write_range(State.kdleaves,
+                desc->kd_leaves * sizeof(*model->leaf_vec),
+                model->leaf_vec);
+        write_range(State.bvh,
+                desc->bvh * sizeof(*model->bvh_vec),
+                model->bvh_vec);
+    }
+    State.bvh_len = total.bvh;
+    if (State.mesh_descs != NULL) {
+        delete_list(State.mesh_descs);
+    }
+    State.mesh_descs = meshes;
+}
+
+/* Upload the models' current bounds, and the instances along with a small
+ * BVH over their world bounds that lets the kernel find the ones a ray can
+ * reach before descending into their model's own tree.
+ */
+static void
+upload_instances(void) {
+    State.samples = 0;
+    kd *models = State.models;
+    Instance *instances = State.instance_vec;
+    size_t instance_count = vector_length(instances);
+    InstanceDesc *descs = new_list(instance_count * sizeof(*descs));
+    Vector3 *mins = new_list(instance_count * sizeof(*mins)),
+            *maxs = new_list(instance_count * sizeof(*maxs));
+    for (size_t i = 0; i < vector_length(State.mesh_descs); i++) {
+        State.mesh_descs[i].min = models[i].min;
+        State.mesh_descs[i].max = models[i].max;
+    }
+    for (size_t i = 0; i < instance_count; i++) {
+        const Instance *inst = &instances[i];
+        int err = 0;
+        Matrix inverse = mat_inverse(inst->transform, &err);
+        if (err) {
+            fprintf(stderr, "Instance %zu has a singular transform\n", i);
+            continue;
+        }
+        Vector3 min = models[inst->model].min, max = models[inst->model].max;
+        transform_bounds(inst->transform, &min, &max);
+        vector_append(descs, ((InstanceDesc){ inverse, inst->model }));
+        vector_append(mins, min);
+        vector_append(maxs, max);
+    }
+    bvhnode *tlas = build_tlas(mins, maxs, vector_length(descs));
+    upload_buffer(&State.meshes, State.mesh_descs);
+    upload_buffer(&State.instances, descs);
+    upload_buffer(&State.tlas, tlas);
+    delete_list(descs);
+    delete_list(mins);
+    delete_list(maxs);
+    delete_list(tlas);
+}
+
+/* Take ownership of 'models' and upload them all as one scene, with each
+ * of 'instances' placing one model in the world.
+ */
+void
+CLSetMeshes(kd *models, const Instance *instances) {
+    if (vector_length(models) == 0 || vector_length(instances) == 0) {
+        return;
+    }
+    State.models = copy_list(models);
+    State.instance_vec = copy_list(instances);
+    upload_geometry();
+    upload_instances();
+}
+
+/* Move the vertices of a BVH model to 'verts', positions in the order the
+ * mesh file lists them, and update the device copy. Each vertex takes the
+ * position its source_vec entry names, so positions the model doesn't use,
+ * or that were welded into an earlier one, are ignored. The tree is
+ * refitted in place, so only the model's vertices, records and nodes are
+ * uploaded again, unless its quality has degraded enough for update_bvh()
+ * to rebuild it.
+ */
+void
+CLUpdateMesh(int model, const Vector4 *verts, const kd_config *config) {
+    kd *tree = &State.models[model];
+    if (tree->accel != ACCEL_BVH) {
+        fprintf(stderr, "Only BVH models can be updated\n");
         return;
     }
-    State.kd = models[0];
-    {
-        Vector4 *verts = State.kd.vert_vec;
-        size_t vertSize = list_size(verts);
-        resize_buffer(&State.verts, vertSize);
-        HANDLE_ERR(clEnqueueWriteBuffer(State.queue,
-                State.verts,
-                CL_TRUE,
-                0,
-                vertSize,
-                verts,
-                0,
-                NULL,
-                NULL));
-    }
-    {
-        Vector4 *norms = State.kd.norm_vec;
-        size_t normSize = list_size(norms);
-        if (normSize > 0) {
-            resize_buffer(&State.norms, normSize);
-            HANDLE_ERR(clEnqueueWriteBuffer(State.queue,
-                    State.norms,
-                    CL_TRUE,
-                    0,
-                    normSize,
-                    norms,
-                    0,
-                    NULL,
-                    NULL));
+    size_t vert_count = vector_length(tree->vert_vec);
+    for (size_t i = 0; i < vert_count; i++) {
+        if ((size_t)tree->source_vec[i] >= vector_length(verts)) {
+            fprintf(stderr, "Updated model has too few vertices\n");
+            return;
         }
     }
-    {
-        cl_int3 *tris = State.kd.tri_vec;
-        size_t triSize = list_size(tris);
-        resize_buffer(&State.tris, triSize);
-        HANDLE_ERR(clEnqueueWriteBuffer(State.queue,
-                State.tris,
-                CL_TRUE,
-                0,
-                triSize,
-                tris,
-                0,
-                NULL,
-                NULL));
-    }
-    {
-        int *triIndices = State.kd.tri_indices;
-        size_t triIndicesSize = list_size(triIndices);
-        resize_buffer(&State.triIndices, triIndicesSize);
-        HANDLE_ERR(clEnqueueWriteBuffer(State.queue,
-                State.triIndices,
-                CL_TRUE,
-                0,
-                triIndicesSize,
-                triIndices,
-                0,
-                NULL,
-                NULL));
-    }
-    {
-        size_t treesize = list_size(State.kd.node_vec);
-        resize_buffer(&State.kdtree, treesize);
-        HANDLE_ERR(clEnqueueWriteBuffer(State.queue,
-                State.kdtree,
-                CL_TRUE,
-                0,
-                treesize,
-                State.kd.node_vec,
-                0,
-                NULL,
-                NULL));
+    for (size_t i = 0; i < vert_count; i++) {
+        tree->vert_vec[i] = verts[tree->source_vec[i]];
+    }
+    MeshDesc desc = State.mesh_descs[model];
+    size_t capacity = ((size_t)model + 1 < vector_length(State.mesh_descs)
+            ? (size_t)State.mesh_descs[model + 1].bvh
+            : State.bvh_len) - desc.bvh;
+    // A rebuilt tree can have more nodes than its slice of the buffer,
+    // shifting every later model.
+    if (update_bvh(tree, config) && vector_length(tree->bvh_vec) > capacity) {
+        upload_geometry();
+        upload_instances();
+        return;
+    }
+    write_verts(desc.verts, tree->vert_vec);
+    write_range(State.records,
+            desc.records * sizeof(*tree->record_vec),
+            tree->record_vec);
+    write_range(State.bvh, desc.bvh * sizeof(*tree->bvh_vec), tree->bvh_vec);
+    upload_instances();
+}
+
+static void
+clear_stats(void) {
+    cl_uint zero[2] = { 0, 0 };
+    HANDLE_ERR(clEnqueueWriteBuffer(State.queue,
+            State.stats,
+            CL_TRUE,
+            0,
+            sizeof(zero),
+            zero,
+            0,
+            NULL,
+            NULL));
+}
+
+/* Add this frame's counts from the kernel to the running totals, clearing
+ * them, and print the totals every STATS_FRAMES frames.
+ */
+static void
+collect_stats(void) {
+    cl_uint counts[2];
+    HANDLE_ERR(clEnqueueReadBuffer(State.queue,
+            State.stats,
+            CL_TRUE,
+            0,
+            sizeof(counts),
+            counts,
+            0,
+            NULL,
+            NULL));
+    State.stats_total[0] += counts[0];
+    State.stats_total[1] += counts[1];
+    clear_stats();
+    if (++State.stats_frames < STATS_FRAMES) {
+        return;
+    }
+    cl_uint tests = State.stats_total[0], skipped = State.stats_total[1];
+    printf("%u triangle tests per frame, mailbox skipped %u (%.1f%%)\n",
+            tests / STATS_FRAMES,
+            skipped / STATS_FRAMES,
+            tests + skipped > 0
+                    ? 100.0 * skipped / ((double)tests + skipped)
+                    : 0.0);
+    State.stats_total[0] = State.stats_total[1] = 0;
+    State.stats_frames = 0;
+}
+
+/* Allocate the accumulation and random state buffers for a 'width' by
+ * 'height' frame, starting the accumulation over, unless they already fit.
+ * The random states are cleared so that the kernel seeds them.
+ */
+static void
+resize_frame(int width, int height) {
+    if (width == State.frame_width && height == State.frame_height) {
+        return;
+    }
+    size_t pixels = (size_t)width * height;
+    resize_buffer_flags(&State.accum,
+            CL_MEM_READ_WRITE,
+            pixels * sizeof(cl_float4));
+    resize_buffer_flags(&State.rng,
+            CL_MEM_READ_WRITE,
+            pixels * sizeof(cl_uint));
+    cl_uint *seeds = calloc(pixels, sizeof(*seeds));
+    if (seeds == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    HANDLE_ERR(clEnqueueWriteBuffer(State.queue,
+            State.rng,
+            CL_TRUE,
+            0,
+            pixels * sizeof(*seeds),
+            seeds,
+            0,
+            NULL,
+            NULL));
+    free(seeds);
+    State.frame_width = width;
+    State.frame_height = height;
+    State.samples = 0;
+}
+
+/* Size the wavefront queues for 'pixels' rays, growing them as needed. */
+static void
+resize_wavefront(size_t pixels) {
+    if (pixels <= State.wave_size) {
+        return;
+    }
+    resize_buffer_flags(&State.rays,
+            CL_MEM_READ_WRITE,
+            pixels * sizeof(PathRay));
+    resize_buffer_flags(&State.next_rays,
+            CL_MEM_READ_WRITE,
+            pixels * sizeof(PathRay));
+    resize_buffer_flags(&State.hits,
+            CL_MEM_READ_WRITE,
+            pixels * sizeof(PathHit));
+    State.wave_size = pixels;
+}
+
+/* Clear the wavefront queue counters and read them back after 'kernel' runs
+ * over 'count' queue entries with 'args'.
+ */
+static void
+run_stage(cl_kernel kernel,
+        const KernelArg *args,
+        size_t count,
+        cl_uint counts[2]) {
+    counts[0] = counts[1] = 0;
+    HANDLE_ERR(clEnqueueWriteBuffer(State.queue,
+            State.counts,
+            CL_FALSE,
+            0,
+            2 * sizeof(*counts),
+            counts,
+            0,
+            NULL,
+            NULL));
+    update_args(kernel, args);
+    CLEnqueueKernel(1, &count, NULL, State.queue, kernel);
+    HANDLE_ERR(clEnqueueReadBuffer(State.queue,
+            State.counts,
+            CL_TRUE,
+            0,
+            2 * sizeof(*counts),
+            counts,
+            0,
+            NULL,
+            NULL));
+}
+
+/* Render a frame with the wavefront kernels, extending and shading the
+ * surviving paths one bounce at a time. The counts read back after each
+ * stage size the next launch to the paths still alive.
+ */
+static void
+execute_wavefront(int width, int height) {
+    resize_wavefront((size_t)width * height);
+    update_args(State.generate, State.generate_args);
+    CLEnqueueKernel(2, (size_t[]){
+            width, height
+    }, NULL, State.queue, State.generate);
+    size_t paths = (size_t)width * height;
+    cl_uint counts[2];
+    while (paths > 0) {
+        run_stage(State.extend, State.extend_args, paths, counts);
+        if (counts[0] == 0) {
+            break;
+        }
+        run_stage(State.shade, State.shade_args, counts[0], counts);
+        paths = counts[1];
+        cl_mem rays = State.rays;
+        State.rays = State.next_rays;
+        State.next_rays = rays;
     }
 }
 
@@ -205,11 +637,24 @@ void
 CLExecute(int width, int height) {
     glFinish();
     update_image(State.queue, &State.image, State.kernel);
-    update_args(State.kernel);
+    resize_frame(width, height);
+    if (State.render.wavefront) {
+        execute_wavefront(width, height);
+    } else {
+        update_args(State.kernel, State.vec_args);
+        CLEnqueueKernel(2, (size_t[]){
+                width, height
+        }, NULL, State.queue, State.kernel);
+    }
+    update_args(State.tonemap, State.tonemap_args);
     CLEnqueueKernel(2, (size_t[]){
             width, height
-    }, NULL, State.queue, State.kernel);
+    }, NULL, State.queue, State.tonemap);
     clFinish(State.queue);
+    State.samples++;
+    if (State.render.stats) {
+        collect_stats();
+    }
     HANDLE_ERR(clEnqueueReleaseGLObjects(State.queue,
             1,
             &State.image,
@@ -220,46 +665,120 @@ CLExecute(int width, int height) {
 
 void
 CLTerminate(void) {
-    delete_kd(State.kd);
+    if (State.models != NULL) {
+        size_t model_count = vector_length(State.models);
+        for (size_t i = 0; i < model_count; i++) {
+            delete_kd(State.models[i]);
+        }
+        delete_list(State.models);
+        delete_list(State.instance_vec);
+        delete_list(State.mesh_descs);
+    }
     delete_list(State.vec_args);
+    delete_list(State.generate_args);
+    delete_list(State.extend_args);
+    delete_list(State.shade_args);
+    delete_list(State.tonemap_args);
+}
+
+static void
+append_buffer_arg(KernelArg **args, cl_mem *buffer) {
+    vector_append(*args, KernelArg(sizeof(*buffer), buffer, 0));
+}
+
+/* The scene buffers, in the order of SCENE_PARAMS in kernel.cl. */
+static void
+append_scene_args(KernelArg **args) {
+    append_buffer_arg(args, &State.verts);
+    append_buffer_arg(args, &State.norms);
+    append_buffer_arg(args, &State.tris);
+    append_buffer_arg(args, &State.records);
+    append_buffer_arg(args, &State.kdtree);
+    append_buffer_arg(args, &State.kdleaves);
+    append_buffer_arg(args, &State.bvh);
+    append_buffer_arg(args, &State.meshes);
+    append_buffer_arg(args, &State.instances);
+    append_buffer_arg(args, &State.tlas);
+    append_buffer_arg(args, &State.stats);
+}
+
+/* The accumulation buffer, random states and sample count that kernels
+ * finishing paths take last.
+ */
+static void
+append_frame_args(KernelArg **args) {
+    append_buffer_arg(args, &State.accum);
+    append_buffer_arg(args, &State.rng);
+    vector_append(*args, KernelArg(sizeof(cl_uint), &State.samples, 1));
 }
 
 void
-CLInit(const char *kernel_filename, const char *kernel_name) {
+CLInit(const char *kernel_filename,
+        const char *kernel_name,
+        const render_config *render) {
+    State.render = *render;
     State.platform = CLGetPlatform();
     State.device = CLGetDevice(State.platform);
     State.context = CLCreateContext(State.platform, State.device);
-    State.program =
-            CLBuildProgram(kernel_filename, State.context, State.device);
+    char options[128];
+    sprintf(options, "-DMAX_DEPTH=%d", render->max_depth);
+    if (render->compress) {
+        strcat(options, " -DCOMPRESSED_GEOMETRY");
+    }
+    if (render->mailbox > 0) {
+        sprintf(options + strlen(options),
+                " -DMAILBOX_SIZE=%d",
+                render->mailbox);
+    }
+    if (render->stats) {
+        strcat(options, " -DTRAVERSAL_STATS");
+    }
+    State.program = CLBuildProgram(kernel_filename,
+            options,
+            State.context,
+            State.device);
     State.queue = CLCreateQueue(State.context, State.device);
     State.kernel = CLCreateKernel(kernel_name, State.program);
-    State.matrix = CLCreateBuffer(State.context, sizeof(Matrix));
-    State.vec_args = new_list(9 * sizeof(*State.vec_args));
-    vector_append(State.vec_args, KernelArg(
-            sizeof(cl_mem), &State.image, 0
-    ));
-    vector_append(State.vec_args, KernelArg(
-            sizeof(cl_mem), &State.matrix, 0
-    ));
-    vector_append(State.vec_args, KernelArg(
-            sizeof(cl_mem), &State.objects, 0
-    ));
+    State.generate = CLCreateKernel("generate", State.program);
+    State.extend = CLCreateKernel("extend", State.program);
+    State.shade = CLCreateKernel("shade", State.program);
+    State.tonemap = CLCreateKernel("tonemap", State.program);
+    State.matrix = CLCreateBuffer(State.context,
+            CL_MEM_READ_ONLY,
+            sizeof(Matrix));
+    State.stats = CLCreateBuffer(State.context,
+            CL_MEM_READ_WRITE,
+            2 * sizeof(cl_uint));
+    clear_stats();
+    State.counts = CLCreateBuffer(State.context,
+            CL_MEM_READ_WRITE,
+            2 * sizeof(cl_uint));
+    State.vec_args = new_list(17 * sizeof(*State.vec_args));
+    append_buffer_arg(&State.vec_args, &State.matrix);
+    append_buffer_arg(&State.vec_args, &State.objects);
     vector_append(State.vec_args, KernelArg(
             sizeof(cl_int), &State.objcount, 1
     ));
-    vector_append(State.vec_args, KernelArg(
-            sizeof(cl_mem), &State.verts, 0
-    ));
-    vector_append(State.vec_args, KernelArg(
-            sizeof(cl_mem), &State.norms, 0
-    ));
-    vector_append(State.vec_args, KernelArg(
-            sizeof(cl_mem), &State.tris, 0
-    ));
-    vector_append(State.vec_args, KernelArg(
-            sizeof(cl_mem), &State.triIndices, 0
-    ));
-    vector_append(State.vec_args, KernelArg(
-            sizeof(cl_mem), &State.kdtree, 0
-    ));
+    append_scene_args(&State.vec_args);
+    append_frame_args(&State.vec_args);
+    State.generate_args = new_list(3 * sizeof(*State.generate_args));
+    append_buffer_arg(&State.generate_args, &State.matrix);
+    append_buffer_arg(&State.generate_args, &State.rays);
+    append_buffer_arg(&State.generate_args, &State.rng);
+    State.extend_args = new_list(17 * sizeof(*State.extend_args));
+    append_scene_args(&State.extend_args);
+    append_buffer_arg(&State.extend_args, &State.rays);
+    append_buffer_arg(&State.extend_args, &State.hits);
+    append_buffer_arg(&State.extend_args, &State.counts);
+    append_frame_args(&State.extend_args);
+    State.shade_args = new_list(18 * sizeof(*State.shade_args));
+    append_scene_args(&State.shade_args);
+    append_buffer_arg(&State.shade_args, &State.rays);
+    append_buffer_arg(&State.shade_args, &State.hits);
+    append_buffer_arg(&State.shade_args, &State.next_rays);
+    append_buffer_arg(&State.shade_args, &State.counts);
+    append_frame_args(&State.shade_args);
+    State.tonemap_args = new_list(2 * sizeof(*State.tonemap_args));
+    append_buffer_arg(&State.tonemap_args, &State.image);
+    append_buffer_arg(&State.tonemap_args, &State.accum);
 }
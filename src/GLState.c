@@ -84,8 +84,13 @@ GLSetObjects(Object *vec_objects, size_t size) {
 }
 
 void
-GLSetMeshes(kd *models) {
-    CLSetMeshes(models);
+GLSetMeshes(kd *models, const Instance *instances) {
+    CLSetMeshes(models, instances);
+}
+
+void
+GLUpdateMesh(int model, const Vector4 *verts, const kd_config *config) {
+    CLUpdateMesh(model, verts, config);
 }
 
 int
@@ -117,7 +122,9 @@ GLTerminate(void) {
 }
 
 void
-GLInit(const char *kernel_filename, const char *kernel_name) {
+GLInit(const char *kernel_filename,
+        const char *kernel_name,
+        const render_config *render) {
     GLInitGLFW();
     State.monitor = GLGetMonitor();
     State.window = GLCreateWindow(State.monitor);
@@ -136,6 +143,6 @@ GLInit(const char *kernel_filename, const char *kernel_name) {
     State.vao = GLSetupRender();
     State.texLoc = glGetUniformLocation(State.shaderProgram, "tex");
     State.texture = GLCreateTexture(State.width, State.height);
-    CLInit(kernel_filename, kernel_name);
+    CLInit(kernel_filename, kernel_name, render);
     CLCreateImage(State.texture);
 }
@@ -0,0 +1,405 @@
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bvh.h"
+#include "list.h"
+
+/* Bounds and centroid of one triangle. Nodes are split by the centroids, so
+ * each triangle lands in exactly one child.
+ */
+typedef struct prim {
+    Vector3 min, max, centroid;
+} prim;
+
+typedef struct tlas_item {
+    Vector3 min, max, centroid;
+    int id;
+    vec_t key;
+} tlas_item;
+
+typedef struct bvh_bin {
+    Vector3 min, max;
+    int count;
+} bvh_bin;
+
+/* State shared by every node of one build. 'bins' and 'right_area' are
+ * scratch space for evaluating one axis at a time.
+ */
+typedef struct bvh_ctx {
+    kd *tree;
+    const kd_config *config;
+    const prim *prims;
+    int max_depth;
+    bvh_bin *bins;
+    vec_t *right_area;
+    int leaf_count;
+} bvh_ctx;
+
+static vec_t
+box_area(Vector3 min, Vector3 max) {
+    Vector3 ext = vec_subtract(max, min);
+    return 2 * (ext.s[0] * ext.s[1] + ext.s[1] * ext.s[2] +
+            ext.s[2] * ext.s[0]);
+}
+
+static int
+bin_of(const prim *p, KD_AXIS axis, vec_t min, vec_t scale, int bins) {
+    int b = (int)((p->centroid.s[axis] - min) * scale);
+    return b < bins
+            ? b
+            : bins - 1;
+}
+
+/* Build the subtree over tri_indices[begin..end) into bvh_vec[index]. */
+static void
+build_subtree(bvh_ctx *ctx, kd_index index, int begin, int end, int depth) {
+    kd *tree = ctx->tree;
+    int *refs = tree->tri_indices;
+    const prim *prims = ctx->prims;
+    Vector3 min = prims[refs[begin]].min, max = prims[refs[begin]].max;
+    Vector3 c_min = prims[refs[begin]].centroid, c_max = c_min;
+    for (int i = begin + 1; i < end; i++) {
+        const prim *p = &prims[refs[i]];
+        min = vec_min(min, p->min);
+        max = vec_max(max, p->max);
+        c_min = vec_min(c_min, p->centroid);
+        c_max = vec_max(c_max, p->centroid);
+    }
+    int count = end - begin;
+    bvhnode node = {
+            { min.s[0], min.s[1], min.s[2] },
+            begin,
+            { max.s[0], max.s[1], max.s[2] },
+            count
+    };
+    vec_t area = box_area(min, max);
+    int bins = ctx->config->bins;
+    // Only splits cheaper than intersecting every triangle are worth taking.
+    vec_t best_cost = (vec_t)count;
+    int best_axis = -1, best_bin = 0;
+    for (KD_AXIS axis = 0; axis < 3 && count > 1 && depth < ctx->max_depth &&
+            area > 0; axis++) {
+        vec_t extent = c_max.s[axis] - c_min.s[axis];
+        if (extent <= 0) {
+            continue;
+        }
+        vec_t scale = bins / extent;
+        for (int b = 0; b < bins; b++) {
+            ctx->bins[b] = (bvh_bin){
+                    Vector3(INFINITY, INFINITY, INFINITY),
+                    Vector3(-INFINITY, -INFINITY, -INFINITY),
+                    0
+            };
+        }
+        for (int i = begin; i < end; i++) {
+            const prim *p = &prims[refs[i]];
+            bvh_bin *bin = &ctx->bins[bin_of(p, axis, c_min.s[axis], scale,
+                    bins)];
+            bin->min = vec_min(bin->min, p->min);
+            bin->max = vec_max(bin->max, p->max);
+            bin->count++;
+        }
+        // Bounds of the right side of every plane, swept from the top. Sides
+        // left empty are never evaluated, so their unset bounds don't matter.
+        Vector3 box_min = ctx->bins[bins - 1].min,
+                box_max = ctx->bins[bins - 1].max;
+        for (int b = bins - 1; b > 0; b--) {
+            box_min = vec_min(box_min, ctx->bins[b].min);
+            box_max = vec_max(box_max, ctx->bins[b].max);
+            ctx->right_area[b] = box_area(box_min, box_max);
+        }
+        box_min = ctx->bins[0].min;
+        box_max = ctx->bins[0].max;
+        int NL = 0;
+        for (int b = 1; b < bins; b++) {
+            box_min = vec_min(box_min, ctx->bins[b - 1].min);
+            box_max = vec_max(box_max, ctx->bins[b - 1].max);
+            NL += ctx->bins[b - 1].count;
+            int NR = count - NL;
+            if (NL == 0 || NR == 0) {
+                continue;
+            }
+            vec_t cost = ctx->config->traverse_cost +
+                    (box_area(box_min, box_max) * NL +
+                            ctx->right_area[b] * NR) / area;
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+    if (best_axis < 0) {
+        tree->bvh_vec[index] = node;
+        ctx->leaf_count++;
+        return;
+    }
+    vec_t scale = bins / (c_max.s[best_axis] - c_min.s[best_axis]);
+    int mid = begin, hi = end;
+    while (mid < hi) {
+        const prim *p = &prims[refs[mid]];
+        if (bin_of(p, best_axis, c_min.s[best_axis], scale, bins) <
+                best_bin) {
+            mid++;
+        } else {
+            int tmp = refs[--hi];
+            refs[hi] = refs[mid];
+            refs[mid] = tmp;
+        }
+    }
+    kd_index pair = vector_length(tree->bvh_vec);
+    vector_resize(tree->bvh_vec, pair + 2);
+    node.start = pair;
+    node.count = -1 - best_axis;
+    tree->bvh_vec[index] = node;
+    build_subtree(ctx, pair, begin, mid, depth + 1);
+    build_subtree(ctx, pair + 1, mid, end, depth + 1);
+}
+
+static vec_t
+bvh_cost(const kd_config *config, const bvhnode *bvh_vec, kd_index index) {
+    bvhnode node = bvh_vec[index];
+    vec_t area = box_area(Vector3(node.min[0], node.min[1], node.min[2]),
+            Vector3(node.max[0], node.max[1], node.max[2]));
+    if (node.count > 0) {
+        return node.count * area;
+    }
+    return config->traverse_cost * area +
+            bvh_cost(config, bvh_vec, node.start) +
+            bvh_cost(config, bvh_vec, node.start + 1);
+}
+
+/* SAH cost of the whole tree, relative to the area of its root. */
+static vec_t
+bvh_sah_cost(const kd_config *config, const kd *tree) {
+    vec_t area = box_area(tree->min, tree->max);
+    return area > 0
+            ? bvh_cost(config, tree->bvh_vec, 0) / area
+            : 0;
+}
+
+kd
+build_bvh(cl_int4 *tris,
+        Vector3 *verts,
+        Vector3 *norms,
+        const kd_config *config) {
+    size_t num_faces = vector_length(tris);
+    kd tree = {
+            .accel = ACCEL_BVH,
+            .node_vec = new_list(0),
+            .leaf_vec = new_list(0),
+            .bvh_vec = new_list(2 * num_faces * sizeof(*tree.bvh_vec)),
+            .tri_indices = new_list(num_faces * sizeof(*tree.tri_indices)),
+            .vert_vec = verts,
+            .norm_vec = norms,
+            .tri_vec = tris
+    };
+    if (num_faces == 0) {
+        tree.record_vec = new_list(0);
+        return tree;
+    }
+    prim *prims = malloc(num_faces * sizeof(*prims));
+    bvh_ctx ctx = {
+            &tree,
+            config,
+            prims,
+            config->max_depth > 0 && config->max_depth < BVH_MAX_DEPTH
+                    ? config->max_depth
+                    : BVH_MAX_DEPTH,
+            malloc(config->bins * sizeof(*ctx.bins)),
+            malloc(config->bins * sizeof(*ctx.right_area)),
+            0
+    };
+    if (prims == NULL || ctx.bins == NULL || ctx.right_area == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < num_faces; i++) {
+        Vector3 A = verts[tris[i].s[0]],
+                B = verts[tris[i].s[1]],
+                C = verts[tris[i].s[2]];
+        Vector3 min = vec_min(vec_min(A, B), C),
+                max = vec_max(vec_max(A, B), C);
+        prims[i] = (prim){
+                min, max, vec_scaled(vec_add(min, max), 0.5f)
+        };
+        vector_append(tree.tri_indices, (int)i);
+    }
+    vector_resize(tree.bvh_vec, 1);
+    build_subtree(&ctx, 0, 0, (int)num_faces, 0);
+    free(prims);
+    free(ctx.bins);
+    free(ctx.right_area);
+
+    bvhnode root = tree.bvh_vec[0];
+    tree.min = Vector3(root.min[0], root.min[1], root.min[2]);
+    tree.max = Vector3(root.max[0], root.max[1], root.max[2]);
+    tree.sah_cost = bvh_sah_cost(config, &tree);
+    kd_update_records(&tree);
+    printf("%zu %d %f\n",
+            num_faces,
+            ctx.leaf_count,
+            (double)num_faces / (double)ctx.leaf_count);
+    printf("SAH cost: %f\n", tree.sah_cost);
+    printf("%zu BVH nodes (%zu bytes)\n",
+            vector_length(tree.bvh_vec),
+            list_size(tree.bvh_vec));
+    return tree;
+}
+
+vec_t
+refit_bvh(kd *tree, const kd_config *config) {
+    bvhnode *nodes = tree->bvh_vec;
+    const cl_int4 *tris = tree->tri_vec;
+    const Vector4 *verts = tree->vert_vec;
+    if (vector_length(nodes) == 0) {
+        return 0;
+    }
+    // Children are always stored after their parent, so a reverse sweep
+    // visits both children of a node before the node itself.
+    for (size_t i = vector_length(nodes); i-- > 0;) {
+        bvhnode *node = &nodes[i];
+        Vector3 min = Vector3(INFINITY, INFINITY, INFINITY),
+                max = Vector3(-INFINITY, -INFINITY, -INFINITY);
+        if (node->count > 0) {
+            for (int j = node->start; j < node->start + node->count; j++) {
+                int b = tree->tri_indices[j];
+                for (int k = 0; k < 3; k++) {
+                    min = vec_min(min, verts[tris[b].s[k]]);
+                    max = vec_max(max, verts[tris[b].s[k]]);
+                }
+            }
+        } else {
+            for (int j = node->start; j < node->start + 2; j++) {
+                min = vec_min(min, Vector3(nodes[j].min[0],
+                        nodes[j].min[1],
+                        nodes[j].min[2]));
+                max = vec_max(max, Vector3(nodes[j].max[0],
+                        nodes[j].max[1],
+                        nodes[j].max[2]));
+            }
+        }
+        for (int k = 0; k < 3; k++) {
+            node->min[k] = min.s[k];
+            node->max[k] = max.s[k];
+        }
+    }
+    tree->min = Vector3(nodes[0].min[0], nodes[0].min[1], nodes[0].min[2]);
+    tree->max = Vector3(nodes[0].max[0], nodes[0].max[1], nodes[0].max[2]);
+    return bvh_sah_cost(config, tree);
+}
+
+int
+update_bvh(kd *tree, const kd_config *config) {
+    if (tree->sah_cost <= 0) {
+        // Trees read from a file don't record their build cost, so the
+        // first update measures it from the bounds they were saved with.
+        tree->sah_cost = bvh_sah_cost(config, tree);
+    }
+    vec_t cost = refit_bvh(tree, config);
+    if (cost <= config->refit_limit * tree->sah_cost) {
+        kd_update_records(tree);
+        return 0;
+    }
+    printf("BVH cost grew from %f to %f, rebuilding...\n",
+            tree->sah_cost,
+            cost);
+    kd_delete_list(tree, tree->node_vec);
+    kd_delete_list(tree, tree->leaf_vec);
+    kd_delete_list(tree, tree->bvh_vec);
+    kd_delete_list(tree, tree->tri_indices);
+    kd_delete_list(tree, tree->record_vec);
+    kd rebuilt = build_bvh(tree->tri_vec,
+            tree->vert_vec,
+            tree->norm_vec,
+            config);
+    rebuilt.source_vec = tree->source_vec;
+    // The mesh itself may still live in the tree's mapping.
+    rebuilt.mapping = tree->mapping;
+    rebuilt.mapping_size = tree->mapping_size;
+    *tree = rebuilt;
+    return 1;
+}
+
+static int
+compare_items(const void *a, const void *b) {
+    const tlas_item *i1 = a, *i2 = b;
+    return (i1->key > i2->key) - (i1->key < i2->key);
+}
+
+static void
+tlas_subtree(bvhnode **nodes,
+        tlas_item *items,
+        kd_index index,
+        int begin,
+        int end) {
+    Vector3 min = items[begin].min, max = items[begin].max;
+    Vector3 c_min = items[begin].centroid, c_max = c_min;
+    for (int i = begin + 1; i < end; i++) {
+        min = vec_min(min, items[i].min);
+        max = vec_max(max, items[i].max);
+        c_min = vec_min(c_min, items[i].centroid);
+        c_max = vec_max(c_max, items[i].centroid);
+    }
+    bvhnode node = {
+            { min.s[0], min.s[1], min.s[2] },
+            items[begin].id,
+            { max.s[0], max.s[1], max.s[2] },
+            1
+    };
+    if (end - begin == 1) {
+        (*nodes)[index] = node;
+        return;
+    }
+    Vector3 ext = vec_subtract(c_max, c_min);
+    KD_AXIS axis = ext.s[0] >= ext.s[1] && ext.s[0] >= ext.s[2]
+            ? KD_X
+            : ext.s[1] >= ext.s[2]
+                    ? KD_Y
+                    : KD_Z;
+    for (int i = begin; i < end; i++) {
+        items[i].key = items[i].centroid.s[axis];
+    }
+    qsort(items + begin, end - begin, sizeof(*items), compare_items);
+    int mid = begin + (end - begin) / 2;
+    kd_index pair = vector_length(*nodes);
+    vector_resize(*nodes, pair + 2);
+    node.start = pair;
+    node.count = -1 - axis;
+    (*nodes)[index] = node;
+    tlas_subtree(nodes, items, pair, begin, mid);
+    tlas_subtree(nodes, items, pair + 1, mid, end);
+}
+
+bvhnode *
+build_tlas(const Vector3 *mins, const Vector3 *maxs, int count) {
+    bvhnode *nodes = new_list((2 * count + 1) * sizeof(*nodes));
+    if (count == 0) {
+        // The kernel always reads the root, so give it one no ray enters.
+        vector_append(nodes, ((bvhnode){
+                { FLT_MAX, FLT_MAX, FLT_MAX }, 0,
+                { -FLT_MAX, -FLT_MAX, -FLT_MAX }, 0
+        }));
+        return nodes;
+    }
+    tlas_item *items = malloc(count * sizeof(*items));
+    if (items == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < count; i++) {
+        items[i] = (tlas_item){
+                mins[i],
+                maxs[i],
+                vec_scaled(vec_add(mins[i], maxs[i]), 0.5f),
+                i,
+                0
+        };
+    }
+    vector_resize(nodes, 1);
+    tlas_subtree(&nodes, items, 0, 0, count);
+    free(items);
+    return nodes;
+}
@@ -1,6 +1,8 @@
 #include <GL/gl3w.h>
 #include <GLFW/glfw3.h>
 #include <math.h>
+#include <stdio.h>
+#include <string.h>
 
 #include "GLState.h"
 #include "camera.h"
@@ -14,6 +16,8 @@
 #define M_PI 3.14159265358979323846
 #endif
 #define CLAMP(x, min, max) ((x) < (min) ? (min) : (x) > (max) ? (max) : (x))
+// Wavelengths of a deformation's ripple across its model.
+#define DEFORM_WAVES 2
 
 static struct {
     struct {
@@ -43,6 +47,19 @@ static struct {
 } State;
 static Object *vec_objects;
 static kd *vec_models;
+
+/* A model whose vertices are rippled every frame by GLUpdateMesh(). 'rest'
+ * holds its positions as the mesh file lists them, and 'moved' the same
+ * positions displaced for the current frame.
+ */
+typedef struct Deformation {
+    int model;
+    kd_config config;
+    vec_t height, frequency;
+    Vector4 *rest;
+    Vector4 *moved;
+} Deformation;
+static Deformation *vec_deforms;
 static int prevScreenPos[2], prevScreenSize[2];
 
 double
@@ -176,6 +193,12 @@ GameTerminate(void) {
     PhysTerminate();
     delete_list(vec_objects);
     delete_list(vec_models);
+    size_t deform_count = vector_length(vec_deforms);
+    for (size_t i = 0; i < deform_count; i++) {
+        delete_list(vec_deforms[i].rest);
+        delete_list(vec_deforms[i].moved);
+    }
+    delete_list(vec_deforms);
 }
 
 static void
@@ -216,6 +239,56 @@ update_objects(void) {
     GLSetObjects(vec_objects, list_size(vec_objects));
 }
 
+/* Start rippling 'tree', loaded as 'model', as 'spec' asks. */
+static void
+add_deformation(int model, const kd *tree, const ModelSpec *spec) {
+    if (tree->accel != ACCEL_BVH) {
+        fprintf(stderr, "%s: only BVH models can be deformed\n",
+                spec->filename);
+        return;
+    }
+    // Recover the file's positions from the vertices welded from them.
+    size_t vert_count = vector_length(tree->vert_vec), pos_count = 0;
+    for (size_t i = 0; i < vert_count; i++) {
+        if ((size_t)tree->source_vec[i] >= pos_count) {
+            pos_count = (size_t)tree->source_vec[i] + 1;
+        }
+    }
+    Vector4 *rest = init_list(pos_count, sizeof(*rest));
+    memset(rest, 0, list_size(rest));
+    for (size_t i = 0; i < vert_count; i++) {
+        rest[tree->source_vec[i]] = tree->vert_vec[i];
+    }
+    Vector3 extent = vec_subtract(tree->max, tree->min);
+    vec_t size = fmaxf(fmaxf(extent.s[0], extent.s[1]), extent.s[2]);
+    vector_append(vec_deforms, ((Deformation){
+            model,
+            spec->config,
+            spec->deform * size,
+            2 * (vec_t)M_PI * DEFORM_WAVES / size,
+            rest,
+            copy_list(rest)
+    }));
+}
+
+/* Move every deformed model's ripple along by the current time. */
+static void
+deform_models(void) {
+    size_t deform_count = vector_length(vec_deforms);
+    for (size_t i = 0; i < deform_count; i++) {
+        Deformation *deform = &vec_deforms[i];
+        size_t pos_count = vector_length(deform->rest);
+        for (size_t j = 0; j < pos_count; j++) {
+            Vector4 pos = deform->rest[j];
+            vec_t phase = (pos.s[0] + pos.s[2]) * deform->frequency +
+                    2 * (vec_t)State.time;
+            pos.s[1] += deform->height * sinf(phase);
+            deform->moved[j] = pos;
+        }
+        GLUpdateMesh(deform->model, deform->moved, &deform->config);
+    }
+}
+
 void
 StartGameLoop(void) {
     double speed;
@@ -238,6 +311,7 @@ StartGameLoop(void) {
         State.camVel = vec_scaled(vec_add(right, forward), speed);
         update_camera();
         update_objects();
+        deform_models();
 
         PhysStep(update_time());
     }
@@ -246,18 +320,49 @@ StartGameLoop(void) {
 void
 GameInit(const char *kernel_filename,
         const char *kernel_name,
-        const char *const *models) {
+        const ModelSpec *models,
+        const render_config *render) {
     size_t model_count = vector_length(models);
     vec_models = new_list(model_count * sizeof(*vec_models));
+    vec_deforms = new_list(0);
+    Instance *instances = new_list(model_count * sizeof(*instances));
+    // The loaded model of each spec, or -1 if it failed to load.
+    int *loaded = new_list(model_count * sizeof(*loaded));
     for (size_t i = 0; i < model_count; i++) {
-        kd tree;
-        if (LoadModel(models[i], &tree)) {
-            continue;
+        int model = -1;
+        size_t j;
+        for (j = 0; j < i; j++) {
+            if (strcmp(models[j].filename, models[i].filename) == 0 &&
+                    memcmp(&models[j].config,
+                            &models[i].config,
+                            sizeof(kd_config)) == 0 &&
+                    models[j].deform == models[i].deform) {
+                break;
+            }
+        }
+        if (j < i) {
+            model = loaded[j];
+        } else {
+            kd tree;
+            if (!LoadModel(models[i].filename, &models[i].config, &tree)) {
+                model = vector_length(vec_models);
+                vector_append(vec_models, tree);
+                if (models[i].deform != 0) {
+                    add_deformation(model, &tree, &models[i]);
+                }
+            }
+        }
+        vector_append(loaded, model);
+        if (model != -1) {
+            vector_append(instances, ((Instance){
+                    model, models[i].transform
+            }));
         }
-        vector_append(vec_models, tree);
     }
-    GLInit(kernel_filename, kernel_name);
-    GLSetMeshes(vec_models);
+    delete_list(loaded);
+    GLInit(kernel_filename, kernel_name, render);
+    GLSetMeshes(vec_models, instances);
+    delete_list(instances);
     GLRegisterKey(GLFW_KEY_ESCAPE, close_window);
     GLRegisterKey(GLFW_KEY_F, toggle_fullscreen);
     GLRegisterKey(GLFW_KEY_W, forward_key);
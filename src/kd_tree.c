@@ -1,320 +1,1838 @@
 #include <math.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "bvh.h"
 #include "kd_tree.h"
 #include "list.h"
+#include "thread_pool.h"
+#include "util.h"
 
-#define DEPTH 15
-#define NBINS 25
 #define EPS 0.000000001
+// Nodes with at least this many triangles fork their children and evaluate
+// their split axes as separate pool tasks.
+#define PARALLEL_MIN_TRIS 4096
+#define ROPE_TASK_DEPTH 8
+#define CLIP_MAX_VERTS 16
 
-typedef struct triangle {
-    int index;
-    vec_t SA;
-    Vector3 V[3], center;
-} triangle;
+/* Bounding box of one triangle, computed once per build. The builders move
+ * only triangle indices around and look these up.
+ */
+typedef struct bounds {
+    Vector3 min, max;
+} bounds;
+
+typedef enum EVENT_TYPE {
+    EVENT_END = 0, EVENT_PLANAR = 1, EVENT_START = 2
+} EVENT_TYPE;
+
+/* A triangle's bound along one axis. Each axis keeps its own list of events,
+ * sorted by position and then by type, so that a single sweep over the list
+ * visits every plane where the triangle counts on either side change.
+ */
+typedef struct event {
+    vec_t pos;
+    EVENT_TYPE type;
+    int tri;
+} event;
 
-static int leafCount = 0;
-static int leafTriCount = 0;
+typedef enum TRI_SIDE {
+    SIDE_BOTH, SIDE_LEFT, SIDE_RIGHT
+} TRI_SIDE;
 
-static kdnode
+typedef struct split {
+    int found;
+    vec_t cost;
+    vec_t value;
+    KD_AXIS axis;
+    int planar_left;
+} split;
+
+/* State shared by every node of one build. */
+typedef struct build_ctx {
+    const kd_config *config;
+    const bounds *boxes;
+    const cl_int4 *tris;
+    const Vector3 *verts;
+    // Sweep side classification: one row of 'num_tris' entries per pool
+    // thread, since concurrent subtrees may hold the same straddling triangle.
+    unsigned char *sides;
+    size_t num_tris;
+    // References that clipping kept out of a child their full bounds reach.
+    atomic_long clipped;
+} build_ctx;
+
+/* Node of the tree while it is being built. compact_tree() lays the
+ * finished tree out as kdnode and kdleaf records.
+ */
+typedef struct build_node {
+    Vector3 min, max;
+    enum {
+        KD_SPLIT, KD_LEAF
+    } type;
+    union {
+        struct {
+            vec_t value;
+            KD_AXIS axis;
+            kd_index children[2];
+        } split;
+        struct {
+            kd_index tris;
+            kd_index tri_count;
+        } leaf;
+    };
+} build_node;
+
+typedef struct build_tree {
+    build_node *node_vec;
+    int *tri_indices;
+} build_tree;
+
+static build_node
 new_leaf(Vector3 min, Vector3 max, kd_index tris, kd_index tri_count) {
-    leafCount++;
-    leafTriCount += tri_count;
-    return (kdnode){
-            min, max, KD_LEAF, .leaf={
-                    tris, tri_count, {
-                            -1, -1, -1, -1, -1, -1
-                    }
-            }
+    return (build_node){
+            min, max, KD_LEAF, .leaf={ tris, tri_count }
     };
 }
 
-static kdnode
+static build_node
 new_split(Vector3 min, Vector3 max, vec_t value, KD_AXIS axis) {
-    return (kdnode){
+    return (build_node){
             min, max, KD_SPLIT, .split={
                     value, axis, { -1, -1 }
             }
     };
 }
 
+/* Lay out the subtree of build node 'index' with its root at
+ * tree->node_vec[at]. Each split's children are appended as a pair, so
+ * every subtree follows its root and the first descent stays close by.
+ */
+static void
+compact_node(kd *tree, const build_node *build, kd_index index, kd_index at) {
+    build_node node = build[index];
+    if (node.type == KD_LEAF) {
+        kd_index leaf = vector_length(tree->leaf_vec);
+        vector_append(tree->leaf_vec, ((kdleaf){
+                node.min, node.max, node.leaf.tris, node.leaf.tri_count, {
+                        -1, -1, -1, -1, -1, -1
+                }
+        }));
+        tree->node_vec[at] = (kdnode){
+                0, (cl_uint)leaf << 2 | KD_LEAF_AXIS
+        };
+        return;
+    }
+    kd_index pair = vector_length(tree->node_vec);
+    vector_resize(tree->node_vec, pair + 2);
+    tree->node_vec[at] = (kdnode){
+            node.split.value, (cl_uint)pair << 2 | node.split.axis
+    };
+    compact_node(tree, build, node.split.children[0], pair);
+    compact_node(tree, build, node.split.children[1], pair + 1);
+}
+
 static void
-optimize_rope(int *rope_ptr, kdnode *node_vec, int index, KD_SIDE face) {
+compact_tree(kd *tree, const build_node *build) {
+    size_t node_count = vector_length(build);
+    tree->node_vec = new_list(node_count * sizeof(*tree->node_vec));
+    size_t leaf_count = (node_count + 1) / 2;
+    tree->leaf_vec = new_list(leaf_count * sizeof(*tree->leaf_vec));
+    vector_resize(tree->node_vec, 1);
+    compact_node(tree, build, 0, 0);
+}
+
+/* Move a rope down to the deepest node still covering the whole 'face' of
+ * the node [min, max].
+ */
+static void
+optimize_rope(kd_index *rope_ptr,
+        const kdnode *node_vec,
+        Vector3 min,
+        Vector3 max,
+        KD_SIDE face) {
     if (*rope_ptr == -1) {
         return;
     }
-    while (node_vec[*rope_ptr].type != KD_LEAF) {
-        if (face / 2 == node_vec[*rope_ptr].split.axis) {
+    while (1) {
+        kdnode rope = node_vec[*rope_ptr];
+        KD_AXIS axis = KD_NODE_AXIS(rope);
+        if (axis == KD_LEAF_AXIS || face / 2 == axis) {
             break;
         }
-        KD_AXIS axis = node_vec[*rope_ptr].split.axis;
-        vec_t value = node_vec[*rope_ptr].split.value;
-        if (value >= node_vec[index].max.s[axis]) {
-            *rope_ptr = node_vec[*rope_ptr].split.children[0];
-        } else if (value <= node_vec[index].min.s[axis]) {
-            *rope_ptr = node_vec[*rope_ptr].split.children[1];
+        if (rope.value >= max.s[axis]) {
+            *rope_ptr = KD_NODE_INDEX(rope);
+        } else if (rope.value <= min.s[axis]) {
+            *rope_ptr = KD_NODE_INDEX(rope) + 1;
         } else {
             break;
         }
     }
 }
 
+typedef struct rope_task {
+    kd *tree;
+    kd_index index;
+    Vector3 min, max;
+    kd_index ropes[6];
+    int depth;
+} rope_task;
+
+static void
+add_ropes(kd *tree,
+        kd_index index,
+        Vector3 min,
+        Vector3 max,
+        kd_index ropes[6],
+        int depth);
+
+static void
+rope_subtree(void *arg) {
+    rope_task *task = arg;
+    add_ropes(task->tree,
+            task->index,
+            task->min,
+            task->max,
+            task->ropes,
+            task->depth);
+}
+
+/* Each leaf only writes its own record and every node only reads nodes
+ * above it, so the two subtrees of a split can be roped concurrently.
+ * Interior nodes carry no bounds, so they are passed down from the root.
+ */
 static void
-add_ropes(kdnode *node_vec, kd_index index, kd_index ropes[6]) {
-    if (node_vec[index].type == KD_LEAF) {
+add_ropes(kd *tree,
+        kd_index index,
+        Vector3 min,
+        Vector3 max,
+        kd_index ropes[6],
+        int depth) {
+    kdnode node = tree->node_vec[index];
+    KD_AXIS axis = KD_NODE_AXIS(node);
+    if (axis == KD_LEAF_AXIS) {
+        kdleaf *leaf = &tree->leaf_vec[KD_NODE_INDEX(node)];
         for (KD_SIDE side = 0; side < 6; side++) {
-            node_vec[index].leaf.ropes[side] = ropes[side];
+            leaf->ropes[side] = ropes[side];
         }
         return;
     }
-    int ropes0[6], ropes1[6];
+    rope_task tasks[2];
     for (KD_SIDE face = 0; face < 6; face++) {
-        optimize_rope(&ropes[face], node_vec, index, face);
-        ropes0[face] = ropes[face];
-        ropes1[face] = ropes[face];
+        optimize_rope(&ropes[face], tree->node_vec, min, max, face);
+        tasks[0].ropes[face] = ropes[face];
+        tasks[1].ropes[face] = ropes[face];
+    }
+    kd_index pair = KD_NODE_INDEX(node);
+    for (int i = 0; i < 2; i++) {
+        tasks[i].tree = tree;
+        tasks[i].index = pair + i;
+        tasks[i].min = min;
+        tasks[i].max = max;
+        tasks[i].ropes[2 * axis + 1 - i] = pair + 1 - i;
+        tasks[i].depth = depth + 1;
+    }
+    tasks[0].max.s[axis] = tasks[1].min.s[axis] = node.value;
+    if (depth < ROPE_TASK_DEPTH) {
+        task_group group = TASK_GROUP_INIT;
+        pool_submit(&group, rope_subtree, &tasks[1]);
+        rope_subtree(&tasks[0]);
+        pool_wait(&group);
+    } else {
+        rope_subtree(&tasks[0]);
+        rope_subtree(&tasks[1]);
     }
-    KD_AXIS axis = node_vec[index].split.axis;
-    ropes0[2 * axis + 1] = node_vec[index].split.children[1];
-    add_ropes(node_vec, node_vec[index].split.children[0], ropes0);
-    ropes1[2 * axis] = node_vec[index].split.children[0];
-    add_ropes(node_vec, node_vec[index].split.children[1], ropes1);
 }
 
-static int *
-concat_tris(int *tris, const triangle *new_tris) {
-    size_t num_tris = vector_length(new_tris);
-    for (size_t i = 0; i < num_tris; i++) {
-        vector_append(tris, new_tris[i].index);
+/* Append a subtree that was built into its own node and index lists, fixing
+ * up its child and triangle offsets. Returns the index of its root.
+ */
+static kd_index
+splice_subtree(build_tree *tree, build_tree subtree) {
+    kd_index node_base = vector_length(tree->node_vec);
+    kd_index tri_base = vector_length(tree->tri_indices);
+    size_t node_len = vector_length(subtree.node_vec);
+    for (size_t i = 0; i < node_len; i++) {
+        build_node *node = &subtree.node_vec[i];
+        if (node->type == KD_LEAF) {
+            node->leaf.tris += tri_base;
+        } else {
+            node->split.children[0] += node_base;
+            node->split.children[1] += node_base;
+        }
+    }
+    vector_concat(tree->node_vec, subtree.node_vec);
+    vector_concat(tree->tri_indices, subtree.tri_indices);
+    delete_list(subtree.node_vec);
+    delete_list(subtree.tri_indices);
+    return node_base;
+}
+
+/* Bounds of the part of triangle 'tri' inside [min, max], found by clipping
+ * it against the box's six planes in turn. Returns 0 if nothing is left.
+ */
+static int
+clip_triangle(const build_ctx *ctx,
+        int tri,
+        Vector3 min,
+        Vector3 max,
+        bounds *box) {
+    Vector3 poly[CLIP_MAX_VERTS], clipped[CLIP_MAX_VERTS];
+    int count = 3;
+    for (int i = 0; i < 3; i++) {
+        poly[i] = ctx->verts[ctx->tris[tri].s[i]];
+    }
+    for (int plane = 0; plane < 6 && count > 0; plane++) {
+        KD_AXIS axis = plane / 2;
+        vec_t sign = plane % 2
+                ? -1
+                : 1;
+        vec_t value = plane % 2
+                ? max.s[axis]
+                : min.s[axis];
+        int n = 0;
+        for (int i = 0; i < count && n + 2 <= CLIP_MAX_VERTS; i++) {
+            Vector3 a = poly[i], b = poly[(i + 1) % count];
+            vec_t da = sign * (a.s[axis] - value),
+                    db = sign * (b.s[axis] - value);
+            if (da >= 0) {
+                clipped[n++] = a;
+            }
+            if ((da >= 0) != (db >= 0)) {
+                Vector3 p = vec_add(a,
+                        vec_scaled(vec_subtract(b, a), da / (da - db)));
+                p.s[axis] = value;
+                clipped[n++] = p;
+            }
+        }
+        count = n;
+        memcpy(poly, clipped, count * sizeof(*poly));
+    }
+    if (count == 0) {
+        return 0;
+    }
+    box->min = box->max = poly[0];
+    for (int i = 1; i < count; i++) {
+        box->min = vec_min(box->min, poly[i]);
+        box->max = vec_max(box->max, poly[i]);
+    }
+    box->min = vec_max(box->min, min);
+    box->max = vec_min(box->max, max);
+    return 1;
+}
+
+/* Bounds of triangle 'tri' as seen from the node [min, max]: clipped to the
+ * node when clipping is enabled and the triangle reaches outside of it.
+ */
+static bounds
+node_bounds(const build_ctx *ctx, int tri, Vector3 min, Vector3 max) {
+    bounds box = ctx->boxes[tri];
+    if (!ctx->config->clip) {
+        return box;
+    }
+    for (KD_AXIS axis = 0; axis < 3; axis++) {
+        if (box.min.s[axis] < min.s[axis] || box.max.s[axis] > max.s[axis]) {
+            bounds clipped;
+            return clip_triangle(ctx, tri, min, max, &clipped)
+                    ? clipped
+                    : box;
+        }
     }
-    return tris; // May have moved if reallocated
+    return box;
 }
 
+/* Append the references refs[begin..] to the tree's index list as a new
+ * leaf, then pop them off the reference stack.
+ */
 static void
-SAH_tree(kd *tree, triangle *tris, Vector3 min, Vector3 max, int depth) {
-    size_t num_tris = vector_length(tris);
-    if (num_tris <= 1 || depth == 0) {
-        kd_index tri_index = vector_length(tree->tri_indices);
-        vector_append(tree->node_vec, new_leaf(min, max, tri_index, num_tris));
-        tree->tri_indices = concat_tris(tree->tri_indices, tris);
+emit_leaf(build_tree *tree,
+        int **refs,
+        size_t begin,
+        Vector3 min,
+        Vector3 max) {
+    size_t count = vector_length(*refs) - begin;
+    kd_index tri_index = vector_length(tree->tri_indices);
+    vector_append(tree->node_vec, new_leaf(min, max, tri_index, count));
+    vector_resize(tree->tri_indices, tri_index + count);
+    memcpy(tree->tri_indices + tri_index,
+            *refs + begin,
+            count * sizeof(**refs));
+    vector_resize(*refs, begin);
+}
+
+static vec_t
+box_area(Vector3 min, Vector3 max) {
+    Vector3 ext = vec_subtract(max, min);
+    return 2 * (ext.s[0] * ext.s[1] + ext.s[1] * ext.s[2] +
+            ext.s[2] * ext.s[0]);
+}
+
+typedef struct weight_entry {
+    kd_index index;
+    Vector3 min, max;
+} weight_entry;
+
+/* Chance, by surface area, that a ray reaching the root reaches each node,
+ * following the splits down from the tree's bounds.
+ */
+static vec_t *
+node_weights(const kd *tree) {
+    size_t node_count = vector_length(tree->node_vec);
+    vec_t *weights = malloc(node_count * sizeof(*weights));
+    if (weights == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    vec_t root_area = box_area(tree->min, tree->max);
+    weight_entry *stack = new_list(0);
+    vector_append(stack, ((weight_entry){ 0, tree->min, tree->max }));
+    while (vector_length(stack) > 0) {
+        weight_entry entry = stack[vector_length(stack) - 1];
+        vector_resize(stack, vector_length(stack) - 1);
+        weights[entry.index] = root_area > 0
+                ? box_area(entry.min, entry.max) / root_area
+                : 1;
+        kdnode node = tree->node_vec[entry.index];
+        KD_AXIS axis = KD_NODE_AXIS(node);
+        if (axis == KD_LEAF_AXIS) {
+            continue;
+        }
+        weight_entry children[2] = { entry, entry };
+        children[0].index = KD_NODE_INDEX(node);
+        children[1].index = KD_NODE_INDEX(node) + 1;
+        children[0].max.s[axis] = children[1].min.s[axis] = node.value;
+        vector_append(stack, children[0]);
+        vector_append(stack, children[1]);
+    }
+    delete_list(stack);
+    return weights;
+}
+
+/* Print the mean distance in bytes from each split to its children, the
+ * share of those steps that leave the split's cache line, and how many such
+ * steps a ray through the root is expected to take, weighting each by
+ * node_weights(). node_vec is taken to start on a line, as in a .kd file.
+ */
+static void
+report_layout(const char *label, const kd *tree) {
+    const kdnode *node_vec = tree->node_vec;
+    size_t node_count = vector_length(node_vec);
+    size_t steps = 0, far = 0;
+    double distance = 0, expected = 0;
+    vec_t *weights = node_weights(tree);
+    for (size_t i = 0; i < node_count; i++) {
+        if (KD_NODE_AXIS(node_vec[i]) == KD_LEAF_AXIS) {
+            continue;
+        }
+        size_t pair = KD_NODE_INDEX(node_vec[i]);
+        for (size_t child = pair; child < pair + 2; child++) {
+            int leaves_line = child / KD_BLOCK_NODES != i / KD_BLOCK_NODES;
+            distance += (double)(child - i) * sizeof(*node_vec);
+            far += leaves_line;
+            expected += leaves_line * weights[child];
+            steps++;
+        }
+    }
+    free(weights);
+    if (steps == 0) {
         return;
     }
+    printf("%s layout: %.1f bytes mean node fetch distance, "
+           "%.1f%% of steps leave the cache line, "
+           "%.2f line changes per ray\n",
+            label,
+            distance / (double)steps,
+            100.0 * (double)far / (double)steps,
+            expected);
+}
+
+/* Reorder the nodes so that each cache line of KD_BLOCK_NODES nodes holds
+ * treelets of sibling pairs, each grown from its first pair by adding the
+ * frontier pair a ray is most likely to reach, with the treelets laid out
+ * depth-first. A treelet stops at the end of its line and its frontier
+ * starts new ones, so smaller treelets fill the rest of a line.
+ * compact_tree()'s pre-order puts a right child after the whole left
+ * subtree, so most right descents started a new cache line. Node 1 is
+ * padding that keeps pairs off line boundaries. Child indices and ropes are
+ * rewritten to match, and the leaf table is renumbered in the new node order
+ * so that neighbouring leaves' records are close together too.
+ */
+static void
+cluster_nodes(kd *tree) {
+    kdnode *old_nodes = tree->node_vec;
+    kdleaf *old_leaves = tree->leaf_vec;
+    size_t node_count = vector_length(old_nodes);
+    size_t leaf_count = vector_length(old_leaves);
+    if (KD_NODE_AXIS(old_nodes[0]) == KD_LEAF_AXIS) {
+        return;
+    }
+    vec_t *weights = node_weights(tree);
+    kd_index *map = malloc(node_count * sizeof(*map));
+    if (map == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    // Pending block roots, as the index of their first node.
+    kd_index *stack = new_list(0);
+    vector_append(stack, KD_NODE_INDEX(old_nodes[0]));
+    map[0] = 0;
+    kd_index next = 2;
+    while (vector_length(stack) > 0) {
+        kd_index queue[1 + KD_BLOCK_NODES];
+        size_t head = 0, tail = 0;
+        size_t room = (KD_BLOCK_NODES - next % KD_BLOCK_NODES) / 2;
+        queue[tail++] = stack[vector_length(stack) - 1];
+        vector_resize(stack, vector_length(stack) - 1);
+        while (head < tail && head < room) {
+            size_t best = head;
+            for (size_t j = head + 1; j < tail; j++) {
+                if (weights[queue[j]] + weights[queue[j] + 1] >
+                        weights[queue[best]] + weights[queue[best] + 1]) {
+                    best = j;
+                }
+            }
+            kd_index pair = queue[best];
+            queue[best] = queue[head];
+            queue[head++] = pair;
+            for (kd_index i = pair; i < pair + 2; i++) {
+                map[i] = next++;
+                if (KD_NODE_AXIS(old_nodes[i]) != KD_LEAF_AXIS) {
+                    queue[tail++] = KD_NODE_INDEX(old_nodes[i]);
+                }
+            }
+        }
+        // Push the frontier in reverse so its first pair is laid out next.
+        while (tail > head) {
+            vector_append(stack, queue[--tail]);
+        }
+    }
+    delete_list(stack);
+    free(weights);
+    kdnode *nodes = new_list((node_count + 1) * sizeof(*nodes));
+    vector_resize(nodes, node_count + 1);
+    for (size_t i = 0; i < node_count; i++) {
+        kdnode node = old_nodes[i];
+        if (KD_NODE_AXIS(node) != KD_LEAF_AXIS) {
+            node.data = (cl_uint)map[KD_NODE_INDEX(node)] << 2 |
+                    KD_NODE_AXIS(node);
+        }
+        nodes[map[i]] = node;
+    }
+    nodes[1] = nodes[0];
+    kdleaf *leaves = new_list(leaf_count * sizeof(*leaves));
+    for (size_t i = 2; i < node_count + 1; i++) {
+        if (KD_NODE_AXIS(nodes[i]) != KD_LEAF_AXIS) {
+            continue;
+        }
+        kdleaf leaf = old_leaves[KD_NODE_INDEX(nodes[i])];
+        for (KD_SIDE side = 0; side < 6; side++) {
+            if (leaf.ropes[side] != -1) {
+                leaf.ropes[side] = map[leaf.ropes[side]];
+            }
+        }
+        nodes[i].data = (cl_uint)vector_length(leaves) << 2 | KD_LEAF_AXIS;
+        vector_append(leaves, leaf);
+    }
+    free(map);
+    delete_list(old_nodes);
+    delete_list(old_leaves);
+    tree->node_vec = nodes;
+    tree->leaf_vec = leaves;
+}
+
+/* A new list whose element i is element order[i] of 'list', for elements of
+ * 'size' bytes. 'list' is freed.
+ */
+static void *
+permute_list(void *list, const int *order, size_t size) {
+    size_t count = list_size(list) / size;
+    char *permuted = init_list(count, size);
+    for (size_t i = 0; i < count; i++) {
+        memcpy(permuted + i * size, (char *)list + order[i] * size, size);
+    }
+    delete_list(list);
+    return permuted;
+}
+
+/* Fill 'order' with the ids in 'uses' in order of first use, followed by
+ * any of the 'count' ids never used, and 'rank' with its inverse. 'uses'
+ * holds 'group_count' groups of 'stride' ints, of which the first 'width'
+ * are ids.
+ */
+static void
+first_use_order(const int *uses,
+        size_t group_count,
+        size_t width,
+        size_t stride,
+        size_t count,
+        int *order,
+        int *rank) {
+    size_t next = 0;
+    for (size_t i = 0; i < count; i++) {
+        rank[i] = -1;
+    }
+    for (size_t i = 0; i < group_count; i++) {
+        for (size_t k = 0; k < width; k++) {
+            int id = uses[i * stride + k];
+            if (rank[id] == -1) {
+                rank[id] = (int)next;
+                order[next++] = id;
+            }
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (rank[i] == -1) {
+            rank[i] = (int)next;
+            order[next++] = (int)i;
+        }
+    }
+}
+
+/* Renumber triangles in the order the leaves first reference them, and
+ * vertices in the order those triangles first use them, so that the
+ * triangles of a leaf and their vertices share a few cache lines instead of
+ * being scattered in file order. A kd-tree's tri_indices are first regrouped
+ * to follow the leaf table, which cluster_nodes() numbered in node order.
+ * A BVH keeps its vertex order, which CLUpdateMesh() callers rely on.
+ * Records must be updated afterwards.
+ */
+static void
+reorder_mesh(kd *tree) {
+    size_t tri_count = vector_length(tree->tri_vec);
+    size_t vert_count = vector_length(tree->vert_vec);
+    size_t ref_count = vector_length(tree->tri_indices);
+    if (tree->accel == ACCEL_KD) {
+        int *refs = new_list(ref_count * sizeof(*refs));
+        size_t leaf_count = vector_length(tree->leaf_vec);
+        for (size_t i = 0; i < leaf_count; i++) {
+            kdleaf *leaf = &tree->leaf_vec[i];
+            kd_index first = (kd_index)vector_length(refs);
+            for (kd_index j = 0; j < leaf->tri_count; j++) {
+                vector_append(refs, tree->tri_indices[leaf->tris + j]);
+            }
+            leaf->tris = first;
+        }
+        delete_list(tree->tri_indices);
+        tree->tri_indices = refs;
+    }
+    size_t max_count = tri_count > vert_count
+            ? tri_count
+            : vert_count;
+    int *order = malloc(max_count * sizeof(*order));
+    int *rank = malloc(max_count * sizeof(*rank));
+    if (order == NULL || rank == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    first_use_order(tree->tri_indices,
+            ref_count,
+            1,
+            1,
+            tri_count,
+            order,
+            rank);
+    for (size_t i = 0; i < ref_count; i++) {
+        tree->tri_indices[i] = rank[tree->tri_indices[i]];
+    }
+    tree->tri_vec = permute_list(tree->tri_vec,
+            order,
+            sizeof(*tree->tri_vec));
+    if (tree->accel == ACCEL_BVH) {
+        free(order);
+        free(rank);
+        return;
+    }
+    // Each triangle's vertex ids are the first three of its ints.
+    first_use_order((const int *)tree->tri_vec,
+            tri_count,
+            3,
+            sizeof(*tree->tri_vec) / sizeof(cl_int),
+            vert_count,
+            order,
+            rank);
+    for (size_t i = 0; i < tri_count; i++) {
+        for (int k = 0; k < 3; k++) {
+            tree->tri_vec[i].s[k] = rank[tree->tri_vec[i].s[k]];
+        }
+    }
+    tree->vert_vec = permute_list(tree->vert_vec,
+            order,
+            sizeof(*tree->vert_vec));
+    if (vector_length(tree->norm_vec) > 0) {
+        tree->norm_vec = permute_list(tree->norm_vec,
+                order,
+                sizeof(*tree->norm_vec));
+    }
+    tree->source_vec = permute_list(tree->source_vec,
+            order,
+            sizeof(*tree->source_vec));
+    free(order);
+    free(rank);
+}
+
+/* Expected cost, in triangle intersections, of splitting the node [min, max]
+ * at 'v' on 'axis' with NL and NR triangles on each side. Splits that cut
+ * off empty space are discounted by the configured bonus, since rays that
+ * cross the empty side finish there without intersecting anything.
+ */
+static vec_t
+split_cost(const kd_config *config,
+        Vector3 min,
+        Vector3 max,
+        KD_AXIS axis,
+        vec_t v,
+        int NL,
+        int NR) {
+    Vector3 L_max = max, R_min = min;
+    L_max.s[axis] = R_min.s[axis] = v;
+    vec_t cost = config->traverse_cost +
+            (box_area(min, L_max) * NL + box_area(R_min, max) * NR) /
+                    box_area(min, max);
+    if (NL == 0 || NR == 0) {
+        cost *= 1 - config->empty_bonus;
+    }
+    return cost;
+}
+
+typedef struct bin {
+    int starts, ends;
+} bin;
+
+typedef struct bin_task {
+    const build_ctx *ctx;
+    const int *refs;
+    size_t begin, end;
+    Vector3 min, max;
+    int bins;
+    bin *counts;
+} bin_task;
+
+/* Count each triangle once per axis: its lowest vertex in the bin it starts
+ * in, and its highest in the bin it ends in. Triangles reaching outside the
+ * node are clamped into the first or last bin.
+ */
+static void
+fill_bins(void *arg) {
+    bin_task *task = arg;
+    int bins = task->bins;
+    task->counts = calloc(3 * bins, sizeof(*task->counts));
+    if (task->counts == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    Vector3 ext = vec_subtract(task->max, task->min);
+    for (size_t t = task->begin; t < task->end; t++) {
+        bounds box =
+                node_bounds(task->ctx, task->refs[t], task->min, task->max);
+        for (KD_AXIS axis = 0; axis < 3; axis++) {
+            if (ext.s[axis] < EPS) {
+                continue;
+            }
+            vec_t scale = bins / ext.s[axis];
+            int b_lo = (int)((box.min.s[axis] - task->min.s[axis]) * scale),
+                    b_hi = (int)((box.max.s[axis] - task->min.s[axis]) * scale);
+            b_lo = b_lo < 0
+                    ? 0
+                    : b_lo >= bins
+                            ? bins - 1
+                            : b_lo;
+            b_hi = b_hi < 0
+                    ? 0
+                    : b_hi >= bins
+                            ? bins - 1
+                            : b_hi;
+            bin *counts = task->counts + axis * bins;
+            counts[b_lo].starts++;
+            counts[b_hi].ends++;
+        }
+    }
+}
+
+/* Evaluate the planes between 'bins' equal bins on every axis from a single
+ * pass over the references refs[begin..end). Nodes large enough to split
+ * across the pool bin separate chunks concurrently and sum the histograms.
+ */
+static split
+bin_axes(const build_ctx *ctx,
+        const int *refs,
+        size_t begin,
+        size_t end,
+        Vector3 min,
+        Vector3 max,
+        int bins) {
+    size_t num_tris = end - begin;
+    int chunks = num_tris >= PARALLEL_MIN_TRIS
+            ? pool_size()
+            : 1;
+    bin_task *tasks = malloc(chunks * sizeof(*tasks));
+    if (tasks == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    task_group group = TASK_GROUP_INIT;
+    for (int i = 0; i < chunks; i++) {
+        tasks[i] = (bin_task){
+                ctx,
+                refs,
+                begin + num_tris * i / chunks,
+                begin + num_tris * (i + 1) / chunks,
+                min,
+                max,
+                bins,
+                NULL
+        };
+        pool_submit(&group, fill_bins, &tasks[i]);
+    }
+    pool_wait(&group);
+    bin *counts = tasks[0].counts;
+    for (int i = 1; i < chunks; i++) {
+        for (int b = 0; b < 3 * bins; b++) {
+            counts[b].starts += tasks[i].counts[b].starts;
+            counts[b].ends += tasks[i].counts[b].ends;
+        }
+        free(tasks[i].counts);
+    }
+    free(tasks);
+
+    // Only planes cheaper than intersecting every triangle are worth taking.
+    split best = { .cost = (vec_t)num_tris };
     Vector3 ext = vec_subtract(max, min);
-    int found = 0;
-    vec_t best_h;
-    KD_AXIS best_axis;
-    vec_t best_v;
-    vec_t box_a[] = {
-            2 * ext.s[1] * ext.s[2],
-            2 * ext.s[0] * ext.s[2],
-            2 * ext.s[0] * ext.s[1]
-    };
     for (KD_AXIS axis = 0; axis < 3; axis++) {
         vec_t e = ext.s[axis];
         if (e < EPS) {
             continue;
         }
-        for (int i = 0; i < NBINS; i++) {
-            vec_t d = (vec_t)(i + 1) / (vec_t)(NBINS + 1);
-            vec_t v = min.s[axis] + d * e;
-            vec_t SL = 2 * (ext.s[(axis + 1) % 3] * ext.s[(axis + 2) % 3] +
-                    e * d * (ext.s[(axis + 1) % 3] + ext.s[(axis + 2) % 3])),
-                    SR = 2 * (ext.s[(axis + 1) % 3] * ext.s[(axis + 2) % 3] +
-                    e * (1 - d) *
-                            (ext.s[(axis + 1) % 3] + ext.s[(axis + 2) % 3]));
-            int NL = 0, NR = 0;
-            for (size_t t = 0; t < num_tris; t++) {
-                triangle tri = tris[t];
-                int isL = 0, isR = 0;
-                for (int j = 0; j < 3 && (!isL || !isR); j++) {
-                    if (tri.V[j].s[axis] <= v) {
-                        isL = 1;
-                    }
-                    if (tri.V[j].s[axis] >= v) {
-                        isR = 1;
-                    }
-                }
-                if (isL) {
-                    NL++;
-                    SL += tri.SA;
-                }
-                if (isR) {
-                    NR++;
-                    SR += tri.SA;
-                }
-                if (found && NL * SL + NR * SR >= best_h) {
-                    break;
-                }
-            }
-            if (!found || NL * SL + NR * SR < best_h) {
-                found = 1;
-                best_h = NL * SL + NR * SR;
-                best_axis = axis;
-                best_v = v;
+        const bin *axis_counts = counts + axis * bins;
+        int NL = 0, NR = num_tris;
+        for (int i = 1; i < bins; i++) {
+            NL += axis_counts[i - 1].starts;
+            NR -= axis_counts[i - 1].ends;
+            vec_t v = min.s[axis] + e * (vec_t)i / (vec_t)bins;
+            vec_t cost = split_cost(ctx->config, min, max, axis, v, NL, NR);
+            if (cost < best.cost) {
+                best = (split){ 1, cost, v, axis, 1 };
             }
         }
     }
-    if (!found || best_v <= min.s[best_axis] || max.s[best_axis] <= best_v) {
-        kd_index tri_index = vector_length(tree->tri_indices);
-        vector_append(tree->node_vec, new_leaf(min, max, tri_index, num_tris));
-        tree->tri_indices = concat_tris(tree->tri_indices, tris);
+    free(counts);
+    return best;
+}
+
+typedef struct axis_task {
+    const kd_config *config;
+    const void *input;
+    int num_tris;
+    Vector3 min, max;
+    KD_AXIS axis;
+    split best;
+} axis_task;
+
+/* Evaluate all three axes with 'func' as concurrent tasks and return the
+ * cheapest result, preferring the lower axis on ties like a serial loop.
+ */
+static split
+parallel_axes(void (*func)(void *),
+        const kd_config *config,
+        const void *const inputs[3],
+        int num_tris,
+        Vector3 min,
+        Vector3 max,
+        split best) {
+    axis_task tasks[3];
+    task_group group = TASK_GROUP_INIT;
+    for (KD_AXIS axis = 0; axis < 3; axis++) {
+        tasks[axis] = (axis_task){
+                config, inputs[axis], num_tris, min, max, axis, best
+        };
+        pool_submit(&group, func, &tasks[axis]);
+    }
+    pool_wait(&group);
+    for (KD_AXIS axis = 0; axis < 3; axis++) {
+        if (tasks[axis].best.found &&
+                (!best.found || tasks[axis].best.cost < best.cost)) {
+            best = tasks[axis].best;
+        }
+    }
+    return best;
+}
+
+typedef struct binned_task {
+    build_tree tree;
+    build_ctx *ctx;
+    int *refs;
+    Vector3 min, max;
+    int depth;
+} binned_task;
+
+static void
+SAH_tree(build_tree *tree,
+        build_ctx *ctx,
+        int **refs,
+        size_t begin,
+        Vector3 min,
+        Vector3 max,
+        int depth);
+
+static void
+binned_subtree(void *arg) {
+    binned_task *task = arg;
+    task->tree.node_vec = new_list(0);
+    task->tree.tri_indices = new_list(0);
+    SAH_tree(&task->tree,
+            task->ctx,
+            &task->refs,
+            0,
+            task->min,
+            task->max,
+            task->depth);
+    delete_list(task->refs);
+}
+
+/* Build the subtree over the references refs[begin..], which sit on top of
+ * the reference stack *refs. They are partitioned in place into
+ * [right only | straddling | left only], and the straddling run is copied
+ * onto the top so that the left child is [left only | straddling] at the
+ * top of the stack and the right child is [right only | straddling] below
+ * it. Every call pops its references before returning, so the stack never
+ * holds more than the triangles plus the straddlers along one path.
+ */
+static void
+SAH_tree(build_tree *tree,
+        build_ctx *ctx,
+        int **refs,
+        size_t begin,
+        Vector3 min,
+        Vector3 max,
+        int depth) {
+    size_t end = vector_length(*refs);
+    size_t num_tris = end - begin;
+    if (num_tris == 0 || depth == 0) {
+        emit_leaf(tree, refs, begin, min, max);
+        return;
+    }
+    split best =
+            bin_axes(ctx, *refs, begin, end, min, max, ctx->config->bins);
+    KD_AXIS best_axis = best.axis;
+    vec_t best_v = best.value;
+    if (!best.found || best_v <= min.s[best_axis] ||
+            max.s[best_axis] <= best_v) {
+        emit_leaf(tree, refs, begin, min, max);
         return;
     }
-    triangle *L_tris = new_list(sizeof(*L_tris) * num_tris),
-            *R_tris = new_list(sizeof(*R_tris) * num_tris);
+    int *r = *refs;
+    size_t lo = begin, mid = begin, hi = end;
+    while (mid < hi) {
+        bounds box = node_bounds(ctx, r[mid], min, max);
+        int isL = box.min.s[best_axis] <= best_v + EPS,
+                isR = box.max.s[best_axis] >= best_v - EPS;
+        if (!isL || !isR) {
+            bounds full = ctx->boxes[r[mid]];
+            if (full.min.s[best_axis] <= best_v + EPS &&
+                    full.max.s[best_axis] >= best_v - EPS) {
+                atomic_fetch_add(&ctx->clipped, 1);
+            }
+        }
+        if (!isL) {
+            int tmp = r[lo];
+            r[lo++] = r[mid];
+            r[mid++] = tmp;
+        } else if (isR) {
+            mid++;
+        } else {
+            int tmp = r[--hi];
+            r[hi] = r[mid];
+            r[mid] = tmp;
+        }
+    }
+    size_t straddling = mid - lo;
+    vector_resize(*refs, end + straddling);
+    memcpy(*refs + end, *refs + lo, straddling * sizeof(**refs));
+
+    Vector3 L_max = max, R_min = min;
+    L_max.s[best_axis] = R_min.s[best_axis] = best_v;
+
+    kd_index index = vector_length(tree->node_vec);
+    vector_append(tree->node_vec, new_split(min, max, best_v, best_axis));
+
+    kd_index L_index, R_index;
+    if (num_tris >= PARALLEL_MIN_TRIS) {
+        // The right child moves to its own stack so both can grow at once.
+        size_t R_count = mid - begin, L_count = end + straddling - mid;
+        binned_task task = {
+                .ctx = ctx, new_list(R_count * sizeof(int)), R_min, max,
+                depth - 1
+        };
+        vector_resize(task.refs, R_count);
+        memcpy(task.refs, *refs + begin, R_count * sizeof(int));
+        memmove(*refs + begin, *refs + mid, L_count * sizeof(int));
+        vector_resize(*refs, begin + L_count);
+        task_group group = TASK_GROUP_INIT;
+        pool_submit(&group, binned_subtree, &task);
+
+        L_index = vector_length(tree->node_vec);
+        SAH_tree(tree, ctx, refs, begin, min, L_max, depth - 1);
+        pool_wait(&group);
+        R_index = splice_subtree(tree, task.tree);
+    } else {
+        L_index = vector_length(tree->node_vec);
+        SAH_tree(tree, ctx, refs, mid, min, L_max, depth - 1);
+
+        R_index = vector_length(tree->node_vec);
+        SAH_tree(tree, ctx, refs, begin, R_min, max, depth - 1);
+    }
+
+    tree->node_vec[index].split.children[0] = L_index;
+    tree->node_vec[index].split.children[1] = R_index;
+}
+
+static int
+compare_events(const void *a, const void *b) {
+    const event *e1 = a, *e2 = b;
+    if (e1->pos != e2->pos) {
+        return e1->pos < e2->pos
+                ? -1
+                : 1;
+    }
+    return (int)e1->type - (int)e2->type;
+}
+
+static void
+append_events(event **events, bounds box, int tri, KD_AXIS axis) {
+    vec_t lo = box.min.s[axis], hi = box.max.s[axis];
+    if (lo == hi) {
+        vector_append(*events, ((event){ lo, EVENT_PLANAR, tri }));
+    } else {
+        vector_append(*events, ((event){ lo, EVENT_START, tri }));
+        vector_append(*events, ((event){ hi, EVENT_END, tri }));
+    }
+}
+
+static event *
+new_events(const bounds *boxes, size_t num_tris, KD_AXIS axis) {
+    event *events = new_list(2 * num_tris * sizeof(*events));
     for (size_t i = 0; i < num_tris; i++) {
-        triangle tri = tris[i];
-        int isL = 0, isR = 0;
-        for (int j = 0; j < 3 && (!isL || !isR); j++) {
-            if (tri.V[j].s[best_axis] <= best_v + EPS) {
-                isL = 1;
+        append_events(&events, boxes[i], (int)i, axis);
+    }
+    qsort(events, vector_length(events), sizeof(*events), compare_events);
+    return events;
+}
+
+typedef struct event_task {
+    const bounds *boxes;
+    size_t num_tris;
+    KD_AXIS axis;
+    event *events;
+} event_task;
+
+static void
+new_events_task(void *arg) {
+    event_task *task = arg;
+    task->events = new_events(task->boxes, task->num_tris, task->axis);
+}
+
+/* Sweep 'num_events' sorted events of one axis, replacing *best whenever a
+ * cheaper plane is found.
+ */
+static void
+sweep_axis(const kd_config *config,
+        const event *events,
+        size_t num_events,
+        int num_tris,
+        Vector3 min,
+        Vector3 max,
+        KD_AXIS axis,
+        split *best) {
+    int NL = 0, NR = num_tris;
+    for (size_t i = 0; i < num_events;) {
+        vec_t v = events[i].pos;
+        int ending = 0, planar = 0, starting = 0;
+        while (i < num_events && events[i].pos == v &&
+                events[i].type == EVENT_END) {
+            ending++;
+            i++;
+        }
+        while (i < num_events && events[i].pos == v &&
+                events[i].type == EVENT_PLANAR) {
+            planar++;
+            i++;
+        }
+        while (i < num_events && events[i].pos == v &&
+                events[i].type == EVENT_START) {
+            starting++;
+            i++;
+        }
+        NR -= planar + ending;
+        if (min.s[axis] < v && v < max.s[axis]) {
+            vec_t cost_l =
+                    split_cost(config, min, max, axis, v, NL + planar, NR),
+                    cost_r =
+                    split_cost(config, min, max, axis, v, NL, NR + planar);
+            vec_t cost = fminf(cost_l, cost_r);
+            if (cost < best->cost) {
+                *best = (split){ 1, cost, v, axis, cost_l <= cost_r };
+            }
+        }
+        NL += starting + planar;
+    }
+}
+
+/* A node's events on one axis: the top of that axis' event stack. */
+typedef struct event_range {
+    event **events;
+    size_t begin;
+} event_range;
+
+static void
+sweep_axis_task(void *arg) {
+    axis_task *task = arg;
+    const event_range *range = task->input;
+    sweep_axis(task->config,
+            *range->events + range->begin,
+            vector_length(*range->events) - range->begin,
+            task->num_tris,
+            task->min,
+            task->max,
+            task->axis,
+            &task->best);
+}
+
+/* A triangle spanning the split plane, with its bounds clipped to each
+ * child. 'in[side]' is 0 if nothing was left of it in that child.
+ */
+typedef struct straddler {
+    int tri;
+    int in[2];
+    bounds box[2];
+} straddler;
+
+typedef struct partition_task {
+    event_range range;
+    const unsigned char *sides;
+    const straddler *straddlers;
+    KD_AXIS axis;
+    size_t R_count;
+} partition_task;
+
+/* Append the events of the triangles not on side 'drop', keeping their
+ * order. Without 'extra', straddling triangles keep their parent events;
+ * with it, they are replaced by the sorted clipped events in 'extra'.
+ */
+static void
+append_side(event **events,
+        size_t begin,
+        size_t end,
+        const unsigned char *sides,
+        TRI_SIDE drop,
+        const event *extra) {
+    size_t extra_count = extra
+            ? vector_length(extra)
+            : 0, j = 0;
+    for (size_t i = begin; i < end; i++) {
+        event e = (*events)[i];
+        if (sides[e.tri] == drop || (extra && sides[e.tri] == SIDE_BOTH)) {
+            continue;
+        }
+        while (j < extra_count && compare_events(&extra[j], &e) < 0) {
+            vector_append(*events, extra[j++]);
+        }
+        vector_append(*events, e);
+    }
+    while (j < extra_count) {
+        vector_append(*events, extra[j++]);
+    }
+}
+
+/* Sorted events on 'axis' of the straddlers' bounds clipped to one side. */
+static event *
+straddler_events(const straddler *straddlers, int side, KD_AXIS axis) {
+    size_t count = vector_length(straddlers);
+    event *events = new_list(2 * count * sizeof(*events));
+    for (size_t i = 0; i < count; i++) {
+        if (straddlers[i].in[side]) {
+            append_events(&events,
+                    straddlers[i].box[side],
+                    straddlers[i].tri,
+                    axis);
+        }
+    }
+    qsort(events, vector_length(events), sizeof(*events), compare_events);
+    return events;
+}
+
+/* Rewrite a node's events in place as [right | left], where each half keeps
+ * the sorted order and straddling triangles appear in both. The halves are
+ * filtered onto the top of the stack and slid down over the parent's
+ * events, so no node below the root has to sort again. Clipped straddlers
+ * are the exception: their few new events are sorted and merged in.
+ */
+static void
+partition_events(void *arg) {
+    partition_task *task = arg;
+    event **events = task->range.events;
+    size_t begin = task->range.begin, end = vector_length(*events);
+    event *L_extra = NULL, *R_extra = NULL;
+    if (task->straddlers) {
+        L_extra = straddler_events(task->straddlers, 0, task->axis);
+        R_extra = straddler_events(task->straddlers, 1, task->axis);
+    }
+    append_side(events, begin, end, task->sides, SIDE_LEFT, R_extra);
+    task->R_count = vector_length(*events) - end;
+    append_side(events, begin, end, task->sides, SIDE_RIGHT, L_extra);
+    if (task->straddlers) {
+        delete_list(L_extra);
+        delete_list(R_extra);
+    }
+    size_t count = vector_length(*events) - end;
+    memmove(*events + begin, *events + end, count * sizeof(**events));
+    vector_resize(*events, begin + count);
+}
+
+typedef struct sweep_task {
+    build_tree tree;
+    event *events[3];
+    int num_tris;
+    build_ctx *ctx;
+    Vector3 min, max;
+    int depth;
+} sweep_task;
+
+static void
+sweep_tree(build_tree *tree,
+        event *events[3],
+        const size_t begin[3],
+        int num_tris,
+        build_ctx *ctx,
+        Vector3 min,
+        Vector3 max,
+        int depth);
+
+static void
+sweep_subtree(void *arg) {
+    sweep_task *task = arg;
+    task->tree.node_vec = new_list(0);
+    task->tree.tri_indices = new_list(0);
+    sweep_tree(&task->tree, task->events, (size_t[3]){
+            0, 0, 0
+    }, task->num_tris, task->ctx, task->min, task->max, task->depth);
+    for (KD_AXIS axis = 0; axis < 3; axis++) {
+        delete_list(task->events[axis]);
+    }
+}
+
+/* Build the subtree over the events events[axis][begin[axis]..] on each
+ * axis. Like SAH_tree(), every call pops its events before returning.
+ */
+static void
+sweep_tree(build_tree *tree,
+        event *events[3],
+        const size_t begin[3],
+        int num_tris,
+        build_ctx *ctx,
+        Vector3 min,
+        Vector3 max,
+        int depth) {
+    int parallel = num_tris >= PARALLEL_MIN_TRIS;
+    event_range ranges[3];
+    for (KD_AXIS axis = 0; axis < 3; axis++) {
+        ranges[axis] = (event_range){ &events[axis], begin[axis] };
+    }
+    split best = { .cost = (vec_t)num_tris };
+    if (num_tris > 0 && depth > 0) {
+        if (parallel) {
+            const void *inputs[3] = { &ranges[0], &ranges[1], &ranges[2] };
+            best = parallel_axes(sweep_axis_task,
+                    ctx->config,
+                    inputs,
+                    num_tris,
+                    min,
+                    max,
+                    best);
+        } else {
+            for (KD_AXIS axis = 0; axis < 3; axis++) {
+                sweep_axis(ctx->config,
+                        events[axis] + begin[axis],
+                        vector_length(events[axis]) - begin[axis],
+                        num_tris,
+                        min,
+                        max,
+                        axis,
+                        &best);
             }
-            if (tri.V[j].s[best_axis] >= best_v - EPS) {
-                isR = 1;
+        }
+    }
+    if (!best.found) {
+        kd_index tri_index = vector_length(tree->tri_indices);
+        vector_append(tree->node_vec, new_leaf(min, max, tri_index, num_tris));
+        size_t end = vector_length(events[KD_X]);
+        for (size_t i = begin[KD_X]; i < end; i++) {
+            if (events[KD_X][i].type != EVENT_END) {
+                vector_append(tree->tri_indices, events[KD_X][i].tri);
             }
         }
-        if (isL) {
-            vector_append(L_tris, tri);
+        for (KD_AXIS axis = 0; axis < 3; axis++) {
+            vector_resize(events[axis], begin[axis]);
         }
-        if (isR) {
-            vector_append(R_tris, tri);
+        return;
+    }
+    KD_AXIS best_axis = best.axis;
+    vec_t best_v = best.value;
+    unsigned char *sides = ctx->sides + pool_thread_index() * ctx->num_tris;
+    const event *split_events = events[best_axis] + begin[best_axis];
+    size_t num_events = vector_length(events[best_axis]) - begin[best_axis];
+    for (size_t i = 0; i < num_events; i++) {
+        sides[split_events[i].tri] = SIDE_BOTH;
+    }
+    for (size_t i = 0; i < num_events; i++) {
+        event e = split_events[i];
+        if (e.type == EVENT_END && e.pos <= best_v) {
+            sides[e.tri] = SIDE_LEFT;
+        } else if (e.type == EVENT_START && e.pos >= best_v) {
+            sides[e.tri] = SIDE_RIGHT;
+        } else if (e.type == EVENT_PLANAR) {
+            if (e.pos < best_v || (e.pos == best_v && best.planar_left)) {
+                sides[e.tri] = SIDE_LEFT;
+            } else {
+                sides[e.tri] = SIDE_RIGHT;
+            }
         }
     }
     Vector3 L_max = max, R_min = min;
     L_max.s[best_axis] = R_min.s[best_axis] = best_v;
 
+    int clip = ctx->config->clip;
+    straddler *straddlers = clip
+            ? new_list(0)
+            : NULL;
+    int NL = 0, NR = 0;
+    for (size_t i = 0; i < num_events; i++) {
+        event e = split_events[i];
+        if (e.type == EVENT_END) {
+            continue;
+        }
+        TRI_SIDE side = sides[e.tri];
+        if (!clip) {
+            NL += side != SIDE_RIGHT;
+            NR += side != SIDE_LEFT;
+        } else if (side == SIDE_BOTH) {
+            straddler s = { .tri = e.tri };
+            s.in[0] = clip_triangle(ctx, e.tri, min, L_max, &s.box[0]);
+            s.in[1] = clip_triangle(ctx, e.tri, R_min, max, &s.box[1]);
+            NL += s.in[0];
+            NR += s.in[1];
+            atomic_fetch_add(&ctx->clipped, !s.in[0] + !s.in[1]);
+            vector_append(straddlers, s);
+        } else {
+            NL += side == SIDE_LEFT;
+            NR += side == SIDE_RIGHT;
+            bounds full = ctx->boxes[e.tri];
+            if (full.min.s[best_axis] < best_v &&
+                    best_v < full.max.s[best_axis]) {
+                atomic_fetch_add(&ctx->clipped, 1);
+            }
+        }
+    }
+    partition_task parts[3];
+    task_group group = TASK_GROUP_INIT;
+    for (KD_AXIS axis = 0; axis < 3; axis++) {
+        parts[axis] = (partition_task){
+                .range = ranges[axis], sides, straddlers, axis
+        };
+        if (parallel) {
+            pool_submit(&group, partition_events, &parts[axis]);
+        } else {
+            partition_events(&parts[axis]);
+        }
+    }
+    pool_wait(&group);
+    if (straddlers) {
+        delete_list(straddlers);
+    }
+
     kd_index index = vector_length(tree->node_vec);
     vector_append(tree->node_vec, new_split(min, max, best_v, best_axis));
 
-    kd_index L_index = vector_length(tree->node_vec);
-    SAH_tree(tree, L_tris, min, L_max, depth - 1);
-    delete_list(L_tris);
+    kd_index L_index, R_index;
+    size_t L_begin[3];
+    for (KD_AXIS axis = 0; axis < 3; axis++) {
+        L_begin[axis] = begin[axis] + parts[axis].R_count;
+    }
+    if (parallel) {
+        // The right child moves to its own stacks so both can grow at once.
+        sweep_task task = {
+                .num_tris = NR, ctx, R_min, max, depth - 1
+        };
+        for (KD_AXIS axis = 0; axis < 3; axis++) {
+            size_t R_count = parts[axis].R_count;
+            size_t L_count = vector_length(events[axis]) - L_begin[axis];
+            task.events[axis] = new_list(R_count * sizeof(event));
+            vector_resize(task.events[axis], R_count);
+            memcpy(task.events[axis],
+                    events[axis] + begin[axis],
+                    R_count * sizeof(event));
+            memmove(events[axis] + begin[axis],
+                    events[axis] + L_begin[axis],
+                    L_count * sizeof(event));
+            vector_resize(events[axis], begin[axis] + L_count);
+        }
+        pool_submit(&group, sweep_subtree, &task);
 
-    kd_index R_index = vector_length(tree->node_vec);
-    SAH_tree(tree, R_tris, R_min, max, depth - 1);
-    delete_list(R_tris);
+        L_index = vector_length(tree->node_vec);
+        sweep_tree(tree, events, begin, NL, ctx, min, L_max, depth - 1);
+        pool_wait(&group);
+        R_index = splice_subtree(tree, task.tree);
+    } else {
+        L_index = vector_length(tree->node_vec);
+        sweep_tree(tree, events, L_begin, NL, ctx, min, L_max, depth - 1);
+
+        R_index = vector_length(tree->node_vec);
+        sweep_tree(tree, events, begin, NR, ctx, R_min, max, depth - 1);
+    }
 
     tree->node_vec[index].split.children[0] = L_index;
     tree->node_vec[index].split.children[1] = R_index;
 }
 
+static vec_t
+tree_cost(const kd_config *config,
+        const build_node *node_vec,
+        kd_index index) {
+    build_node node = node_vec[index];
+    Vector3 min = node.min, max = node.max;
+    if (node.type == KD_LEAF) {
+        return node.leaf.tri_count * box_area(min, max);
+    }
+    return config->traverse_cost * box_area(min, max) +
+            tree_cost(config, node_vec, node.split.children[0]) +
+            tree_cost(config, node_vec, node.split.children[1]);
+}
+
+/* The .kd file starts with a kd_file_header, followed by each of the tree's
+ * lists as a section. Sections start on KD_SECTION_ALIGN byte boundaries
+ * with at least LIST_HEADER_SIZE bytes before them, so that parse_kd() can
+ * map the file and use every section as a list in place. The header carries
+ * a checksum of itself, checked on every load, and one of each section,
+ * which is only checked when asked for since it reads the whole file.
+ */
+#define KD_FILE_MAGIC "CLPTKD\r\n"
+#define KD_FILE_VERSION 7
+#define KD_SECTION_ALIGN 64
+
+typedef enum KD_SECTION {
+    KD_SECTION_NODES,
+    KD_SECTION_LEAVES,
+    KD_SECTION_BVH,
+    KD_SECTION_VERTS,
+    KD_SECTION_NORMS,
+    KD_SECTION_SOURCES,
+    KD_SECTION_TRI_INDICES,
+    KD_SECTION_RECORDS,
+    KD_SECTION_TRIS,
+    KD_SECTION_COUNT
+} KD_SECTION;
+
+typedef struct kd_section {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t checksum;
+} kd_section;
+
+typedef struct kd_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t section_count;
+    int32_t accel;
+    float min[3], max[3];
+    uint32_t reserved;
+    kd_section sections[KD_SECTION_COUNT];
+    uint64_t checksum;
+} kd_file_header;
+
+static void **
+section_list(kd *tree, KD_SECTION section) {
+    switch (section) {
+        case KD_SECTION_NODES:
+            return (void **)&tree->node_vec;
+        case KD_SECTION_LEAVES:
+            return (void **)&tree->leaf_vec;
+        case KD_SECTION_BVH:
+            return (void **)&tree->bvh_vec;
+        case KD_SECTION_VERTS:
+            return (void **)&tree->vert_vec;
+        case KD_SECTION_NORMS:
+            return (void **)&tree->norm_vec;
+        case KD_SECTION_SOURCES:
+            return (void **)&tree->source_vec;
+        case KD_SECTION_TRI_INDICES:
+            return (void **)&tree->tri_indices;
+        case KD_SECTION_RECORDS:
+            return (void **)&tree->record_vec;
+        case KD_SECTION_TRIS:
+        default:
+            return (void **)&tree->tri_vec;
+    }
+}
+
+static size_t
+section_element_size(KD_SECTION section) {
+    kd tree;
+    switch (section) {
+        case KD_SECTION_NODES:
+            return sizeof(*tree.node_vec);
+        case KD_SECTION_LEAVES:
+            return sizeof(*tree.leaf_vec);
+        case KD_SECTION_BVH:
+            return sizeof(*tree.bvh_vec);
+        case KD_SECTION_VERTS:
+            return sizeof(*tree.vert_vec);
+        case KD_SECTION_NORMS:
+            return sizeof(*tree.norm_vec);
+        case KD_SECTION_SOURCES:
+            return sizeof(*tree.source_vec);
+        case KD_SECTION_TRI_INDICES:
+            return sizeof(*tree.tri_indices);
+        case KD_SECTION_RECORDS:
+            return sizeof(*tree.record_vec);
+        case KD_SECTION_TRIS:
+        default:
+            return sizeof(*tree.tri_vec);
+    }
+}
+
+/* Number of elements in one of the sections listed by 'header'. */
+static uint64_t
+section_length(const kd_file_header *header, KD_SECTION section) {
+    return header->sections[section].size / section_element_size(section);
+}
+
+/* Checksum of 'header' as it would be with its own checksum zeroed. */
+static uint64_t
+header_checksum(kd_file_header header) {
+    header.checksum = 0;
+    return hash_data(&header, sizeof(header), 0);
+}
+
+static uint64_t
+align_section(uint64_t offset) {
+    return (offset + KD_SECTION_ALIGN - 1) / KD_SECTION_ALIGN *
+            KD_SECTION_ALIGN;
+}
+
+/* Write 'tree' to 'path', or nothing if 'path' is NULL. The file is written
+ * under a temporary name and renamed into place once complete, so readers
+ * never see a partial tree.
+ */
+static void
+write_kd(const kd *tree, const char *path) {
+    if (path == NULL) {
+        return;
+    }
+    char *temp_path;
+    FILE *file = create_temp_file(path, &temp_path);
+    if (file == NULL) {
+        return;
+    }
+    kd_file_header header = {
+            .version = KD_FILE_VERSION,
+            .section_count = KD_SECTION_COUNT,
+            .accel = tree->accel,
+            .min = { tree->min.s[0], tree->min.s[1], tree->min.s[2] },
+            .max = { tree->max.s[0], tree->max.s[1], tree->max.s[2] }
+    };
+    memcpy(header.magic, KD_FILE_MAGIC, sizeof(header.magic));
+    uint64_t offset = sizeof(header);
+    for (int i = 0; i < KD_SECTION_COUNT; i++) {
+        const void *list = *section_list((kd *)tree, i);
+        offset = align_section(offset + LIST_HEADER_SIZE);
+        header.sections[i] = (kd_section){
+                offset, list_size(list), hash_data(list, list_size(list), 0)
+        };
+        offset += list_size(list);
+    }
+    header.checksum = header_checksum(header);
+    static const char padding[KD_SECTION_ALIGN + LIST_HEADER_SIZE];
+    fwrite(&header, sizeof(header), 1, file);
+    offset = sizeof(header);
+    for (int i = 0; i < KD_SECTION_COUNT; i++) {
+        const kd_section *section = &header.sections[i];
+        fwrite(padding, 1, section->offset - offset, file);
+        fwrite(*section_list((kd *)tree, i), 1, section->size, file);
+        offset = section->offset + section->size;
+    }
+    publish_file(file, temp_path, path);
+    free(temp_path);
+}
+
 kd
-build_kd(cl_int3 *tris, Vector3 *verts, Vector3 *norms, const char *path) {
-    size_t num_tris = vector_length(tris);
-    kd tree = {
-            new_list(0),
-            new_list(num_tris * sizeof(*tree.tri_indices)),
-            verts,
-            norms,
-            tris
+build_kd(cl_int4 *tris,
+        Vector3 *verts,
+        Vector3 *norms,
+        int *sources,
+        const kd_config *config,
+        const char *path) {
+    if (config->accel == ACCEL_BVH) {
+        kd tree = build_bvh(tris, verts, norms, config);
+        tree.source_vec = sources;
+        if (vector_length(tris) > 0) {
+            reorder_mesh(&tree);
+            kd_update_records(&tree);
+            write_kd(&tree, path);
+        }
+        return tree;
+    }
+    size_t num_faces = vector_length(tris);
+    if (num_faces == 0) {
+        return (kd){
+                .accel = ACCEL_KD,
+                .node_vec = new_list(0),
+                .leaf_vec = new_list(0),
+                .bvh_vec = new_list(0),
+                .tri_indices = new_list(0),
+                .record_vec = new_list(0),
+                .vert_vec = verts,
+                .norm_vec = norms,
+                .source_vec = sources,
+                .tri_vec = tris
+        };
+    }
+    build_tree build = {
+            new_list(0), new_list(num_faces * sizeof(*build.tri_indices))
     };
-    triangle *triangles = new_list(num_tris * sizeof(*triangles));
+    bounds *boxes = malloc(num_faces * sizeof(*boxes));
+    if (boxes == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
     Vector3 min, max;
     min = max = verts[tris[0].s[0]];
-    for (size_t i = 0; i < num_tris / 3; i++) {
-        Vector3 A = verts[tris[3 * i + 0].s[0]],
-                B = verts[tris[3 * i + 1].s[0]],
-                C = verts[tris[3 * i + 2].s[0]];
-        Vector3 S1 = vec_subtract(B, A), S2 = vec_subtract(C, A);
-        Vector3 N = vec_cross(S1, S2);
-        min = vec_min(min, vec_min(vec_min(A, B), C));
-        max = vec_max(max, vec_max(vec_max(A, B), C));
-        vector_append(triangles, ((triangle){
-                i, vec_length(N) / 2, {
-                        A, B, C
-                }, vec_scaled(vec_add(vec_add(A, B), C), 1.0f / 3.0f)
-        }));
+    for (size_t i = 0; i < num_faces; i++) {
+        Vector3 A = verts[tris[i].s[0]],
+                B = verts[tris[i].s[1]],
+                C = verts[tris[i].s[2]];
+        boxes[i] = (bounds){
+                vec_min(vec_min(A, B), C), vec_max(vec_max(A, B), C)
+        };
+        min = vec_min(min, boxes[i].min);
+        max = vec_max(max, boxes[i].max);
+    }
+    // Unless fixed by the caller, allow depth to grow with the mesh, which
+    // the cost model alone keeps from over-splitting small meshes.
+    int depth = config->max_depth > 0
+            ? config->max_depth
+            : (int)lround(8 + 1.3 * log2((double)num_faces));
+    build_ctx ctx = {
+            config, boxes, tris, verts, .num_tris = num_faces
+    };
+    atomic_init(&ctx.clipped, 0);
+    switch (config->builder) {
+        case KD_BUILD_SWEEP:
+            ctx.sides = malloc(pool_size() * num_faces);
+            if (ctx.sides == NULL) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+            }
+            event_task event_tasks[3];
+            task_group group = TASK_GROUP_INIT;
+            for (KD_AXIS axis = 0; axis < 3; axis++) {
+                event_tasks[axis] = (event_task){
+                        .boxes = boxes, .num_tris = num_faces, .axis = axis
+                };
+                pool_submit(&group, new_events_task, &event_tasks[axis]);
+            }
+            pool_wait(&group);
+            event *events[3] = {
+                    event_tasks[0].events,
+                    event_tasks[1].events,
+                    event_tasks[2].events
+            };
+            sweep_tree(&build, events, (size_t[3]){
+                    0, 0, 0
+            }, num_faces, &ctx, min, max, depth);
+            for (KD_AXIS axis = 0; axis < 3; axis++) {
+                delete_list(events[axis]);
+            }
+            free(ctx.sides);
+            break;
+        case KD_BUILD_BINNED:
+        default:;
+            int *refs = new_list(num_faces * sizeof(*refs));
+            for (size_t i = 0; i < num_faces; i++) {
+                vector_append(refs, (int)i);
+            }
+            SAH_tree(&build, &ctx, &refs, 0, min, max, depth);
+            delete_list(refs);
+            break;
+    }
+    free(boxes);
+    int leafCount = 0, leafTriCount = 0;
+    size_t node_count = vector_length(build.node_vec);
+    for (size_t i = 0; i < node_count; i++) {
+        if (build.node_vec[i].type == KD_LEAF) {
+            leafCount++;
+            leafTriCount += build.node_vec[i].leaf.tri_count;
+        }
     }
-    SAH_tree(&tree, triangles, min, max, DEPTH);
-    //new_build_tree(&tree, triangles, min, max, KD_X, DEPTH);
-    delete_list(triangles);
     printf("%d %d %f\n",
             leafTriCount,
             leafCount,
             (double)leafTriCount / (double)leafCount);
-    add_ropes(tree.node_vec, 0, (kd_index[6]){
-            -1, -1, -1, -1, -1, -1
-    });
-    if (path) {
-        size_t size = snprintf(NULL, 0, "%s.kd", path);
-        char *kdpath = malloc(size + 1);
-        if (kdpath == NULL) {
-            perror("malloc");
-            exit(EXIT_FAILURE);
-        }
-        sprintf(kdpath, "%s.kd", path);
-        FILE *file = fopen(kdpath, "wb");
-        free(kdpath);
-
-        size_t node_len = vector_length(tree.node_vec);
-        fwrite(&node_len, sizeof(node_len), 1, file);
-        fwrite(tree.node_vec, sizeof(*tree.node_vec), node_len, file);
-
-        size_t vert_len = vector_length(tree.vert_vec);
-        fwrite(&vert_len, sizeof(vert_len), 1, file);
-        fwrite(tree.vert_vec, sizeof(*tree.vert_vec), vert_len, file);
-
-        size_t norm_len = vector_length(tree.norm_vec);
-        fwrite(&norm_len, sizeof(norm_len), 1, file);
-        fwrite(tree.norm_vec, sizeof(*tree.norm_vec), norm_len, file);
-
-        size_t tri_index_len = vector_length(tree.tri_indices);
-        fwrite(&tri_index_len, sizeof(tri_index_len), 1, file);
-        fwrite(tree.tri_indices,
-                sizeof(*tree.tri_indices),
-                tri_index_len,
-                file);
-
-        size_t tri_len = vector_length(tree.tri_vec);
-        fwrite(&tri_len, sizeof(tri_len), 1, file);
-        fwrite(tree.tri_vec, sizeof(*tree.tri_vec), tri_len, file);
-
-        fclose(file);
+    if (config->clip) {
+        long clipped = atomic_load(&ctx.clipped);
+        printf("Clipping kept %ld references out of child nodes\n", clipped);
     }
+    printf("SAH cost: %f\n",
+            tree_cost(config, build.node_vec, 0) / box_area(min, max));
+    kd tree = {
+            .accel = ACCEL_KD,
+            .bvh_vec = new_list(0),
+            .tri_indices = build.tri_indices,
+            .vert_vec = verts,
+            .norm_vec = norms,
+            .source_vec = sources,
+            .tri_vec = tris,
+            .min = min,
+            .max = max
+    };
+    compact_tree(&tree, build.node_vec);
+    delete_list(build.node_vec);
+    printf("%zu nodes (%zu bytes), %zu leaves (%zu bytes)\n",
+            vector_length(tree.node_vec),
+            list_size(tree.node_vec),
+            vector_length(tree.leaf_vec),
+            list_size(tree.leaf_vec));
+    add_ropes(&tree, 0, min, max, (kd_index[6]){
+            -1, -1, -1, -1, -1, -1
+    }, 0);
+    report_layout("Pre-order", &tree);
+    cluster_nodes(&tree);
+    report_layout("Clustered", &tree);
+    reorder_mesh(&tree);
+    kd_update_records(&tree);
+    write_kd(&tree, path);
     return tree;
 }
 
+/* Report why 'filename' can't be used and release its mapping. */
+static int
+invalid_kd(const char *filename, const char *reason, void *file, size_t size) {
+    fprintf(stderr, "%s: %s\n", filename, reason);
+    unmap_file(file, size);
+    return 1;
+}
+
 int
-parse_kd(const char *filename, kd *tree) {
-    FILE *file = fopen(filename, "rb");
-
-    size_t node_len;
-    fread(&node_len, sizeof(node_len), 1, file);
-    tree->node_vec = init_list(node_len, sizeof(*tree->node_vec));
-    fread(tree->node_vec, sizeof(*tree->node_vec), node_len, file);
-
-    size_t vert_len;
-    fread(&vert_len, sizeof(vert_len), 1, file);
-    tree->vert_vec = init_list(vert_len, sizeof(*tree->vert_vec));
-    fread((Vector4 *)tree->vert_vec, sizeof(*tree->vert_vec), vert_len, file);
-
-    size_t norm_len;
-    fread(&norm_len, sizeof(norm_len), 1, file);
-    tree->norm_vec = init_list(norm_len, sizeof(*tree->norm_vec));
-    fread((Vector4 *)tree->norm_vec, sizeof(*tree->norm_vec), norm_len, file);
-
-    size_t tri_index_len;
-    fread(&tri_index_len, sizeof(tri_index_len), 1, file);
-    tree->tri_indices = init_list(tri_index_len, sizeof(*tree->tri_indices));
-    fread((Vector4 *)tree->tri_indices,
-            sizeof(*tree->tri_indices),
-            tri_index_len,
-            file);
-
-    size_t tri_len;
-    fread(&tri_len, sizeof(tri_len), 1, file);
-    tree->tri_vec = init_list(tri_len, sizeof(*tree->tri_vec));
-    fread(tree->tri_vec, sizeof(*tree->tri_vec), tri_len, file);
+parse_kd(const char *filename, kd *tree, int verify) {
+    size_t size;
+    char *file = map_file(filename, &size);
+    if (file == NULL) {
+        return 1;
+    }
+    kd_file_header header;
+    if (size < sizeof(header)) {
+        return invalid_kd(filename, "not a kd file", file, size);
+    }
+    memcpy(&header, file, sizeof(header));
+    if (memcmp(header.magic, KD_FILE_MAGIC, sizeof(header.magic)) != 0) {
+        return invalid_kd(filename, "not a kd file", file, size);
+    }
+    if (header.version != KD_FILE_VERSION ||
+            header.section_count != KD_SECTION_COUNT) {
+        return invalid_kd(filename,
+                "written by another version, delete it to rebuild",
+                file,
+                size);
+    }
+    if (header_checksum(header) != header.checksum) {
+        return invalid_kd(filename, "corrupt header", file, size);
+    }
+    // Sections must be aligned, in order, and leave room in front for the
+    // list headers wrap_list() writes.
+    uint64_t end = sizeof(header);
+    for (int i = 0; i < KD_SECTION_COUNT; i++) {
+        const kd_section *section = &header.sections[i];
+        if (section->offset % KD_SECTION_ALIGN != 0 ||
+                section->offset < end + LIST_HEADER_SIZE ||
+                section->offset > size ||
+                section->size > size - section->offset ||
+                section->size % section_element_size(i) != 0) {
+            return invalid_kd(filename, "corrupt section table", file, size);
+        }
+        end = section->offset + section->size;
+    }
+    // Lists that must be parallel can be checked from the table alone.
+    uint64_t verts = section_length(&header, KD_SECTION_VERTS),
+            norms = section_length(&header, KD_SECTION_NORMS);
+    if (section_length(&header, KD_SECTION_SOURCES) != verts ||
+            (norms != 0 && norms != verts) ||
+            section_length(&header, KD_SECTION_RECORDS) !=
+                    section_length(&header, KD_SECTION_TRI_INDICES)) {
+        return invalid_kd(filename, "corrupt section table", file, size);
+    }
+    for (int i = 0; verify && i < KD_SECTION_COUNT; i++) {
+        const kd_section *section = &header.sections[i];
+        if (hash_data(file + section->offset, section->size, 0) !=
+                section->checksum) {
+            return invalid_kd(filename, "checksum mismatch", file, size);
+        }
+    }
+    for (int i = 0; i < KD_SECTION_COUNT; i++) {
+        const kd_section *section = &header.sections[i];
+        *section_list(tree, i) = wrap_list(file + section->offset,
+                section->size);
+    }
 
+    tree->accel = header.accel == ACCEL_BVH
+            ? ACCEL_BVH
+            : ACCEL_KD;
+    tree->min = Vector3(header.min[0], header.min[1], header.min[2]);
+    tree->max = Vector3(header.max[0], header.max[1], header.max[2]);
+    tree->sah_cost = 0;
+    tree->mapping = file;
+    tree->mapping_size = size;
     return 0;
 }
 
+void
+kd_update_records(kd *tree) {
+    size_t count = vector_length(tree->tri_indices);
+    if (tree->record_vec == NULL ||
+            vector_length(tree->record_vec) != count) {
+        kd_delete_list(tree, tree->record_vec);
+        tree->record_vec = init_list(count, sizeof(*tree->record_vec));
+    }
+    for (size_t i = 0; i < count; i++) {
+        cl_int index = tree->tri_indices[i];
+        cl_int4 tri = tree->tri_vec[index];
+        Vector4 v0 = tree->vert_vec[tri.s[0]];
+        kdrecord record = {
+                v0,
+                vec_subtract(tree->vert_vec[tri.s[1]], v0),
+                vec_subtract(tree->vert_vec[tri.s[2]], v0)
+        };
+        memcpy(&record.v0.s[3], &index, sizeof(index));
+        record.e1.s[3] = record.e2.s[3] = 0;
+        tree->record_vec[i] = record;
+    }
+}
+
+void
+kd_delete_list(const kd *tree, void *list) {
+    const char *ptr = list, *mapping = tree->mapping;
+    if (mapping != NULL && ptr >= mapping &&
+            ptr < mapping + tree->mapping_size) {
+        return;
+    }
+    delete_list(list);
+}
+
 void
 delete_kd(kd tree) {
-    delete_list(tree.node_vec);
-    delete_list(tree.tri_vec);
-    delete_list(tree.norm_vec);
-    delete_list(tree.vert_vec);
-    delete_list(tree.tri_indices);
+    for (int i = 0; i < KD_SECTION_COUNT; i++) {
+        kd_delete_list(&tree, *section_list(&tree, i));
+    }
+    if (tree.mapping != NULL) {
+        unmap_file(tree.mapping, tree.mapping_size);
+    }
 }
@@ -45,25 +45,72 @@ typedef enum KD_SIDE {
     KD_FRONT = 5
 } KD_SIDE;
 
-typedef struct __attribute__((__packed__)) kdnode {
-    vec3 min, max;
-    enum {
-        KD_SPLIT, KD_LEAF
-    } type;
-    union {
-        struct {
-            vec_t value;
-            KD_AXIS axis;
-            int children[2];
-        } split;
-        struct {
-            int tris;
-            int tri_count;
-            int ropes[6];
-        } leaf;
-    };
+#define KD_LEAF_AXIS 3
+#define KD_NODE_AXIS(node) ((node).data & 3)
+#define KD_NODE_INDEX(node) ((int)((node).data >> 2))
+
+typedef struct kdnode {
+    vec_t value;
+    uint data;
 } kdnode;
 
+typedef struct kdleaf {
+    vec3 min, max;
+    int tris;
+    int tri_count;
+    int ropes[6];
+} kdleaf;
+
+typedef enum ACCEL_TYPE {
+    ACCEL_KD, ACCEL_BVH
+} ACCEL_TYPE;
+
+/* One entry of a leaf's triangle run: the triangle's first vertex, with
+ * the triangle's index in the bits of w, and its two edges. Mirrors
+ * kdrecord in kd_tree.h.
+ */
+typedef struct Record {
+    vec4 v0, e1, e2;
+} Record;
+
+// Set in a triangle's w if its vertices have normals, as in kd_tree.h.
+#define TRI_SMOOTH 1
+
+// Built with COMPRESSED_GEOMETRY, positions are packed float3s and normals
+// octahedral encodings written by CLState.c, instead of 16-byte vectors.
+#ifdef COMPRESSED_GEOMETRY
+#define vert_t vec_t
+#define norm_t uint
+#define load_vert(verts, i) vload3((i), (verts))
+#define load_norm(norms, i) oct_decode((norms)[i])
+#else
+#define vert_t vec4
+#define norm_t vec4
+#define load_vert(verts, i) ((verts)[i].xyz)
+#define load_norm(norms, i) ((norms)[i].xyz)
+#endif
+
+// Built with TRAVERSAL_STATS, the triangle tests made and those skipped by
+// the mailbox are counted in 'stats', which CLState.c reads back.
+#define STAT_TESTS 0
+#define STAT_SKIPPED 1
+
+// MAX_DEPTH, the most segments a path may have, is set by CLState.c. Light
+// from beyond the scene is BACKGROUND, and surfaces mirror REFLECTANCE of
+// the light reaching them.
+#define BACKGROUND 1.0f
+#define REFLECTANCE 0.2f
+
+// Deep enough for any BVH up to BVH_MAX_DEPTH in bvh.h.
+#define BVH_STACK_SIZE 64
+
+typedef struct bvhnode {
+    float min[3];
+    int start;
+    float max[3];
+    int count;
+} bvhnode;
+
 typedef struct Hit {
     float dist;
     global Object *obj;
@@ -93,6 +140,14 @@ mul(const matrix M, vec3 X) {
             dot(M[2].xyz, X) + M[2].w) / (dot(M[3].xyz, X) + M[3].w);
 }
 
+/* Apply the linear part of M to the direction X, without normalizing it so
+ * that distances along the ray are unchanged.
+ */
+vec3
+mul_dir(const matrix M, vec3 X) {
+    return new_vec3(dot(M[0].xyz, X), dot(M[1].xyz, X), dot(M[2].xyz, X));
+}
+
 vec_t
 mod(vec_t a, vec_t b) {
     return fmod(fmod(a, b) + b, b);
@@ -224,16 +279,15 @@ hit_sphere(vec3 center, vec_t radius2, vec3 start, vec3 dir, vec_t *t) {
     return true;
 }
 
+/* Intersect the triangle at 'v0' spanned by the edges 'v0v1' and 'v0v2'. */
 bool
 hit_triangle(vec3 v0,
-        vec3 v1,
-        vec3 v2,
+        vec3 v0v1,
+        vec3 v0v2,
         vec3 start,
         vec3 dir,
         vec_t *t,
         vec2 *uv) {
-    vec3 v0v1 = v1 - v0;
-    vec3 v0v2 = v2 - v0;
     vec3 pvec = cross(dir, v0v2);
     vec_t det = dot(v0v1, pvec);
     if (det < EPS) {
@@ -256,26 +310,13 @@ hit_triangle(vec3 v0,
 
 int
 get_leaf(global kdnode *kd_tree, int index, vec3 point) {
+    vec_t p[3] = { point.x, point.y, point.z };
     kdnode curr = kd_tree[index];
-    if (curr.type == KD_LEAF) {
-        return index;
+    while (KD_NODE_AXIS(curr) != KD_LEAF_AXIS) {
+        index = KD_NODE_INDEX(curr) + (p[KD_NODE_AXIS(curr)] > curr.value);
+        curr = kd_tree[index];
     }
-    vec_t v;
-    switch (curr.split.axis) {
-        case KD_X:
-            v = (-curr.min.x + point.x) / (curr.max.x - curr.min.x);
-            break;
-        case KD_Y:
-            v = (-curr.min.y + point.y) / (curr.max.y - curr.min.y);
-            break;
-        case KD_Z:
-            v = (-curr.min.z + point.z) / (curr.max.x - curr.min.z);
-            break;
-    }
-    if (v < curr.split.value) {
-        return get_leaf(kd_tree, curr.split.children[0], point);
-    }
-    return get_leaf(kd_tree, curr.split.children[1], point);
+    return index;
 }
 
 void
@@ -293,181 +334,639 @@ typedef union vec_arr {
     vec3 vector;
 } vec_arr;
 
-color
-trace_ray(Ray r,
-        global Object *objects,
-        int objcount,
-        global vec4 *verts,
-        global vec4 *norms,
-        global int3 *tris,
-        global int *tri_indices,
-        global kdnode *kd_tree,
-        int depth,
-        color col,
-        float str,
-        bool isPrinter) {
-    vec_t tmin, tmax, minHit;
+/* Offsets of one model's data in the scene buffers, and its bounds. */
+typedef struct MeshDesc {
+    vec3 min, max;
+    int accel;
+    int verts, norms, tris, records, kd_nodes, kd_leaves, bvh;
+} MeshDesc;
+
+/* One placement of a mesh, holding the transform from world space into
+ * the mesh's own space.
+ */
+typedef struct InstanceDesc {
+    matrix world_to_object;
+    int mesh;
+} InstanceDesc;
+
+/* All models' buffers, concatenated, their instances, and the BVH over the
+ * instances' world bounds.
+ */
+typedef struct Scene {
+    global vert_t *verts;
+    global norm_t *norms;
+    global int4 *tris;
+    global Record *records;
+    global kdnode *kd_tree;
+    global kdleaf *kd_leaves;
+    global bvhnode *bvh;
+    global MeshDesc *meshes;
+    global InstanceDesc *instances;
+    global bvhnode *tlas;
+    global uint *stats;
+} Scene;
+
+// Kernel parameters for the scene buffers, in the order CLState.c sets them,
+// and the Scene built from them.
+#define SCENE_PARAMS \
+        global vert_t *verts, \
+        global norm_t *norms, \
+        global int4 *tris, \
+        global Record *records, \
+        global kdnode *kd_tree, \
+        global kdleaf *kd_leaves, \
+        global bvhnode *bvh, \
+        global MeshDesc *meshes, \
+        global InstanceDesc *instances, \
+        global bvhnode *tlas, \
+        global uint *stats
+#define SCENE_ARGS ((Scene){ \
+        verts, norms, tris, records, kd_tree, kd_leaves, bvh, meshes, \
+        instances, tlas, stats \
+})
+
+/* One model's view of the scene buffers and the acceleration structure
+ * built over it. Only the structure selected by 'accel' is populated.
+ * 'instance' is the placement of the model being intersected.
+ */
+typedef struct Mesh {
+    int id;
+    int instance;
+    global vert_t *verts;
+    global norm_t *norms;
+    global int4 *tris;
+    global Record *records;
+    int accel;
+    global kdnode *kd_tree;
+    global kdleaf *kd_leaves;
+    vec3 kd_min, kd_max;
+    global bvhnode *bvh;
+    global uint *stats;
+} Mesh;
+
+Mesh
+get_mesh(Scene scene, int id) {
+    MeshDesc desc = scene.meshes[id];
+    return (Mesh){
+            id,
+            -1,
+            scene.verts + desc.verts,
+            scene.norms + desc.norms,
+            scene.tris + desc.tris,
+            scene.records + desc.records,
+            desc.accel,
+            scene.kd_tree + desc.kd_nodes,
+            scene.kd_leaves + desc.kd_leaves,
+            desc.min,
+            desc.max,
+            scene.bvh + desc.bvh,
+            scene.stats
+    };
+}
+
+#ifdef COMPRESSED_GEOMETRY
+/* Unit normal from its octahedral encoding, unfolding the lower half. */
+vec3
+oct_decode(uint bits) {
+    vec2 e = max((vec2)((short)(bits & 0xffff), (short)(bits >> 16)) /
+            32767.0f, -1.0f);
+    vec3 n = new_vec3(e.x, e.y, 1.0f - fabs(e.x) - fabs(e.y));
+    if (n.z < 0) {
+        n.xy = ((vec2)(1.0f) - fabs(e.yx)) * copysign((vec2)(1.0f), e);
+    }
+    return normalize(n);
+}
+#endif
+
+/* The closest intersection found so far along a ray. */
+typedef struct TriHit {
+    vec_t dist;
+    int instance;
+    int mesh;
+    int tri;
+    vec2 uv;
+} TriHit;
+
+#ifdef MAILBOX_SIZE
+/* The last MAILBOX_SIZE triangles a ray tested in one mesh, overwriting the
+ * oldest. A triangle straddling several kd leaves is met again in each leaf
+ * the ray ropes through, but its result can't change, so it is only tested
+ * once.
+ */
+typedef struct Mailbox {
+    int tris[MAILBOX_SIZE];
+    int next;
+} Mailbox;
+
+void
+mailbox_init(Mailbox *box) {
+    for (int i = 0; i < MAILBOX_SIZE; i++) {
+        box->tris[i] = -1;
+    }
+    box->next = 0;
+}
+
+/* Whether 'tri' is in the mailbox, adding it if not. */
+bool
+mailbox_seen(Mailbox *box, int tri) {
+    if (box == 0) {
+        return false;
+    }
+    for (int i = 0; i < MAILBOX_SIZE; i++) {
+        if (box->tris[i] == tri) {
+            return true;
+        }
+    }
+    box->tris[box->next] = tri;
+    box->next = (box->next + 1) % MAILBOX_SIZE;
+    return false;
+}
+#else
+typedef int Mailbox;
+#define mailbox_init(box)
+#define mailbox_seen(box, tri) false
+#endif
+
+/* Intersect a run of records, skipping triangles in 'mailbox' if it isn't
+ * null.
+ */
+void
+hit_tris(Mesh mesh,
+        Ray r,
+        int first,
+        int count,
+        Mailbox *mailbox,
+        bool *didHit,
+        TriHit *hit) {
+    uint skipped = 0;
+    for (int i = 0; i < count; i++) {
+        Record rec = mesh.records[first + i];
+        if (mailbox_seen(mailbox, as_int(rec.v0.w))) {
+            skipped++;
+            continue;
+        }
+        vec_t t = 0;
+        vec2 uv;
+        if (hit_triangle(rec.v0.xyz,
+                rec.e1.xyz,
+                rec.e2.xyz,
+                r.orig,
+                r.dir,
+                &t,
+                &uv)) {
+            if (!*didHit || t <= hit->dist) {
+                *didHit = true;
+                *hit = (TriHit){
+                        t, mesh.instance, mesh.id, as_int(rec.v0.w), uv
+                };
+            }
+        }
+    }
+#ifdef TRAVERSAL_STATS
+    atomic_add(&mesh.stats[STAT_TESTS], count - skipped);
+    atomic_add(&mesh.stats[STAT_SKIPPED], skipped);
+#endif
+}
+
+/* World space normal at a hit. Normals are carried out of the mesh's space
+ * by the transpose of its world-to-object matrix.
+ */
+vec3
+hit_normal(Scene scene, TriHit hit) {
+    Mesh mesh = get_mesh(scene, hit.mesh);
+    global vec4 *M = scene.instances[hit.instance].world_to_object;
+    int4 tri = mesh.tris[hit.tri];
+    vec3 n;
+    if (tri.w & TRI_SMOOTH) {
+        n = load_norm(mesh.norms, tri.x) * (1.0f - hit.uv.x - hit.uv.y) +
+                load_norm(mesh.norms, tri.y) * hit.uv.x +
+                load_norm(mesh.norms, tri.z) * hit.uv.y;
+    } else {
+        vec3 v1 = load_vert(mesh.verts, tri.x),
+                v2 = load_vert(mesh.verts, tri.y),
+                v3 = load_vert(mesh.verts, tri.z);
+        n = cross(v2 - v1, v3 - v1);
+    }
+    return normalize(n.x * M[0].xyz + n.y * M[1].xyz + n.z * M[2].xyz);
+}
+
+/* Whether a ray enters 'node' before the closest hit found so far. */
+bool
+enter_bvhnode(bvhnode node, Ray r, bool didHit, TriHit *hit) {
+    vec_t tmin, tmax;
     KD_SIDE near, far;
-    if (depth > 0 && hit_AABB((vec3[]){
-            kd_tree[0].min, kd_tree[0].max
+    return hit_AABB((vec3[]){
+            new_vec3(node.min[0], node.min[1], node.min[2]),
+            new_vec3(node.max[0], node.max[1], node.max[2])
+    }, r, &tmin, &tmax, &near, &far) && (!didHit || tmin <= hit->dist);
+}
+
+/* Push an interior node's children far side first along their split
+ * axis, so the near child is visited first and can cull the far one with
+ * its hit distance.
+ */
+void
+push_children(bvhnode node, Ray r, int *stack, int *top) {
+    int axis = -1 - node.count;
+    int neg = axis == KD_X
+            ? r.sign.x
+            : axis == KD_Y
+                    ? r.sign.y
+                    : r.sign.z;
+    stack[(*top)++] = node.start + !neg;
+    stack[(*top)++] = node.start + neg;
+}
+
+/* Each intersect_*() function takes the closest hit found so far in other
+ * meshes, if 'didHit', and returns whether there is one after its mesh.
+ */
+bool
+intersect_kd(Mesh mesh, Ray r, TriHit *hit, bool didHit) {
+    vec_t tmin, tmax;
+    KD_SIDE near, far;
+    if (!hit_AABB((vec3[]){
+            mesh.kd_min, mesh.kd_max
     }, r, &tmin, &tmax, &near, &far)) {
-        vec_arr p1;
-        p1.vector = r.orig;
-        if (tmin > 0) {
-            p1.vector += tmin * r.dir;
+        return didHit;
+    }
+    vec_arr p1;
+    p1.vector = r.orig;
+    if (tmin > 0) {
+        p1.vector += tmin * r.dir;
+    }
+    Mailbox mailbox;
+    mailbox_init(&mailbox);
+    int index = 0;
+    while (index != -1) {
+        kdnode node = mesh.kd_tree[index];
+        while (KD_NODE_AXIS(node) != KD_LEAF_AXIS) {
+            int cond = p1.scalar[KD_NODE_AXIS(node)] > node.value;
+            node = mesh.kd_tree[KD_NODE_INDEX(node) + cond];
         }
-        int index = 0, didHit = 0;
-        vec_t minHit = 0;
-        vec3 normal = 0;
-        int count = 0;
-        while (index != -1) {
-            count++;
-            while (kd_tree[index].type == KD_SPLIT) {
-                int axis = kd_tree[index].split.axis;
-                int cond = p1.scalar[axis] > kd_tree[index].split.value;
-                index = kd_tree[index].split.children[cond];
-                count++;
-            }
-            count += kd_tree[index].leaf.tri_count;
-            if (kd_tree[index].leaf.tris != -1) {
-                for (int i = 0; i < kd_tree[index].leaf.tri_count; i++) {
-                    int a = kd_tree[index].leaf.tris + i;
-                    int b = tri_indices[a];
-                    int3 t1 = tris[3*b+0],
-                         t2 = tris[3*b+1],
-                         t3 = tris[3*b+2];
-                    vec3 v1 = verts[t1.x].xyz, v2 = verts[t2.x].xyz,
-                            v3 = verts[t3.x].xyz;
-                    vec_t t = 0;
-                    vec2 uv;
-                    if (hit_triangle(v1, v2, v3, r.orig, r.dir, &t, &uv)) {
-                        if (!didHit || t <= minHit) {
-                            didHit = 1;
-                            minHit = t;
-
-                            //normal = norms[t1.y].xyz;
-                            if (t1.y >= 0) {
-                                vec3 A = new_vec3((t1.x % 256) / 255.0,
-                                        ((t1.x / 256) % 256) / 255.0,
-                                        ((t1.x / 256 / 256) % 256) / 255.0),
-                                    B = new_vec3((t2.x % 256) / 255.0,
-                                        ((t2.x / 256) % 256) / 255.0,
-                                        ((t2.x / 256 / 256) % 256) / 255.0),
-                                    C = new_vec3((t3.x % 256) / 255.0,
-                                        ((t3.x / 256) % 256) / 255.0,
-                                        ((t3.x / 256 / 256) % 256) / 255.0);
-                                normal = normalize(norms[t1.y].xyz *
-                                        (1.0f - uv.x - uv.y) +
-                                        norms[t2.y].xyz * uv.x +
-                                        norms[t3.y].xyz * uv.y);
-                            } else {
-                                normal = normalize(cross(v2 - v1, v3 - v1));
-                            }
-                        }
-                    }
-                }
-            }
-            traverse_AABB((vec3[]){
-                    kd_tree[index].min, kd_tree[index].max
-            }, r, &tmin, &tmax, &far);
-            /*
-            col = (1-str)*col + str*(1+new_color(
-                (far == KD_LEFT) - (far == KD_RIGHT),
-                (far == KD_DOWN) - (far == KD_UP),
-                (far == KD_BACK) - (far == KD_FRONT)
-            ))/2;
-            str *= 0.8;
-            */
-            if (didHit && tmin + 0.001 > minHit) {
-                break;
-            }
-            index = kd_tree[index].leaf.ropes[far];
-            p1.vector = r.orig + tmax * r.dir;
-            if (index == -1) {
-                break;
+        global kdleaf *leaf = &mesh.kd_leaves[KD_NODE_INDEX(node)];
+        if (leaf->tris != -1) {
+            hit_tris(mesh,
+                    r,
+                    leaf->tris,
+                    leaf->tri_count,
+                    &mailbox,
+                    &didHit,
+                    hit);
+        }
+        traverse_AABB((vec3[]){
+                leaf->min, leaf->max
+        }, r, &tmin, &tmax, &far);
+        if (didHit && tmin + 0.001 > hit->dist) {
+            break;
+        }
+        index = leaf->ropes[far];
+        p1.vector = r.orig + tmax * r.dir;
+    }
+    return didHit;
+}
+
+/* Depth-first BVH traversal with a fixed stack. */
+bool
+intersect_bvh(Mesh mesh, Ray r, TriHit *hit, bool didHit) {
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        bvhnode node = mesh.bvh[stack[--top]];
+        if (!enter_bvhnode(node, r, didHit, hit)) {
+            continue;
+        }
+        if (node.count > 0) {
+            hit_tris(mesh, r, node.start, node.count, 0, &didHit, hit);
+        } else {
+            push_children(node, r, stack, &top);
+        }
+    }
+    return didHit;
+}
+
+/* Walk the top-level BVH over the instances' world bounds, descending into
+ * each instance the ray reaches with its mesh's own structure. The ray is
+ * moved into the mesh's space with its direction left unnormalized, so hit
+ * distances stay comparable across instances.
+ */
+bool
+intersect_scene(Scene scene, Ray r, TriHit *hit) {
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+    bool didHit = false;
+    while (top > 0) {
+        bvhnode node = scene.tlas[stack[--top]];
+        if (!enter_bvhnode(node, r, didHit, hit)) {
+            continue;
+        }
+        if (node.count > 0) {
+            for (int i = 0; i < node.count; i++) {
+                InstanceDesc inst = scene.instances[node.start + i];
+                Mesh mesh = get_mesh(scene, inst.mesh);
+                mesh.instance = node.start + i;
+                Ray local = new_Ray(mul(inst.world_to_object, r.orig),
+                        mul_dir(inst.world_to_object, r.dir));
+                didHit = mesh.accel == ACCEL_BVH
+                        ? intersect_bvh(mesh, local, hit, didHit)
+                        : intersect_kd(mesh, local, hit, didHit);
             }
+        } else {
+            push_children(node, r, stack, &top);
         }
-        //int G = count % 256;
-        //int R = count / 256 % 256;
-        //R = (256 - R) % 256;
-        //int B = count / 256 / 256 % 256;
-        //B = (256 - B) % 256;
-        if (didHit) {
-            return convert_color((normal + 1) / 2)/* / 2 +
-                new_color(R / 255.0, G / 255.5, B / 255.5) / 2*/;
-
-            vec3 newOrig = r.orig + r.dir * minHit;
-            vec3 newDir = normalize(r.dir - 2 * dot(r.dir, normal) * normal);
-            newOrig += newDir * 0.0001f;
-            Ray newRay = new_Ray(newOrig, newDir);
-            col = (1 - str) * col + str * convert_color((normal + 1) / 2);
-            str *= 0.2f;
-            //return convert_color((normal + 1) / 2);
-            return trace_ray(newRay,
-                    objects,
-                    objcount,
-                    verts,
-                    norms,
-                    tris,
-                    tri_indices,
-                    kd_tree,
-                    depth - 1,
-                    col,
-                    str,
-                    isPrinter);
+    }
+    return didHit;
+}
+
+/* Hash of 'x', used to seed a pixel's random numbers. */
+uint
+hash_uint(uint x) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+/* Nonzero xorshift state for the random numbers of 'pixel'. */
+uint
+rng_seed(uint pixel) {
+    return hash_uint(pixel) | 1;
+}
+
+/* Uniform random number in [0, 1), advancing the xorshift 'state'. */
+float
+random_float(uint *state) {
+    uint x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+/* Radiance of a path that leaves the scene. */
+color
+path_miss(color radiance, color throughput) {
+    return radiance + throughput * BACKGROUND;
+}
+
+/* Add the surface at 'hit' to a path of 'depth' segments so far, and turn
+ * 'r' into the path's next segment, mirrored about the surface. The surface
+ * gives back its normal as a colour for all but REFLECTANCE of the light,
+ * which it reflects. Returns false if the path ends here instead, either
+ * at MAX_DEPTH or by Russian roulette: past the first bounce, a path
+ * survives with probability equal to its throughput, and survivors are
+ * scaled up to match, so dim paths stop early without biasing the image.
+ */
+bool
+path_hit(Scene scene,
+        TriHit hit,
+        int depth,
+        Ray *r,
+        color *radiance,
+        color *throughput,
+        uint *seed) {
+    vec3 normal = hit_normal(scene, hit);
+    *radiance += *throughput * (1 - REFLECTANCE) *
+            convert_color((normal + 1) / 2);
+    *throughput *= REFLECTANCE;
+    if (depth + 1 >= MAX_DEPTH) {
+        return false;
+    }
+    if (depth > 0) {
+        float survive = min(max(throughput->x,
+                max(throughput->y, throughput->z)), 1.0f);
+        if (random_float(seed) >= survive) {
+            return false;
+        }
+        *throughput /= survive;
+    }
+    vec3 orig = r->orig + r->dir * hit.dist;
+    vec3 dir = normalize(r->dir - 2 * dot(r->dir, normal) * normal);
+    *r = new_Ray(orig + dir * 0.0001f, dir);
+    return true;
+}
+
+/* Follow the path starting with 'r' and return the radiance it gathers. The
+ * path's throughput lives in registers rather than on a call stack.
+ */
+color
+trace_path(Ray r, Scene scene, uint *seed) {
+    color radiance = 0, throughput = 1;
+    for (int depth = 0; ; depth++) {
+        TriHit hit;
+        if (!intersect_scene(scene, r, &hit)) {
+            return path_miss(radiance, throughput);
+        }
+        if (!path_hit(scene, hit, depth, &r, &radiance, &throughput, seed)) {
+            return radiance;
         }
-        //return new_color(R / 255.0, G / 255.5, B / 255.5)/2;
     }
-    return (1-str)*col + str;
+}
+
+/* Primary ray through the point (x, y) of a resX by resY image, in pixels,
+ * from the camera whose inverse view-projection matrix is 'cam'.
+ */
+Ray
+camera_ray(global vec4 cam[4], vec_t x, vec_t y, uint resX, uint resY) {
+    const vec3 origin = new_vec3(cam[0].z / cam[3].z,
+            cam[1].z / cam[3].z,
+            cam[2].z / cam[3].z);
+    const vec3 ncp = mul(cam,
+            new_vec3(x - (vec_t)resX / 2, y - (vec_t)resY / 2, -1));
+    const vec3 fcp = mul(cam,
+            new_vec3(x - (vec_t)resX / 2, y - (vec_t)resY / 2, 1));
+    return new_Ray(origin, normalize(fcp - ncp));
+}
+
+/* Camera ray through a random point of pixel (x, y), so that accumulated
+ * samples antialias the image.
+ */
+Ray
+pixel_ray(global vec4 cam[4],
+        uint x,
+        uint y,
+        uint resX,
+        uint resY,
+        uint *seed) {
+    vec_t dx = random_float(seed) - 0.5f;
+    vec_t dy = random_float(seed) - 0.5f;
+    return camera_ray(cam, x + dx, y + dy, resX, resY);
+}
+
+/* The random state 'pixel' left off with, seeding it on first use. CLState.c
+ * clears the states when it allocates them.
+ */
+uint
+load_seed(global uint *rng, int pixel) {
+    uint seed = rng[pixel];
+    return seed != 0
+            ? seed
+            : rng_seed(pixel);
+}
+
+/* Add a finished path's radiance to the running sum of its pixel, which
+ * 'samples', the number of frames already summed, being 0 starts over, and
+ * keep the pixel's random state for its next path.
+ */
+void
+finish_path(global color4 *accum,
+        global uint *rng,
+        uint samples,
+        int pixel,
+        color radiance,
+        uint seed) {
+    color4 sum = samples > 0
+            ? accum[pixel]
+            : (color4)(0);
+    accum[pixel] = sum + (color4)(radiance, 1);
+    rng[pixel] = seed;
 }
 
 kernel void
-render(write_only image2d_t image,
-        global vec4 cam[4],
+render(global vec4 cam[4],
         global struct Object *objects,
         int objcount,
-        global vec4 *verts,
-        global vec4 *norms,
-        global int3 *tris,
-        global int *tri_indices,
-        global kdnode *kd_tree) {
+        SCENE_PARAMS,
+        global color4 *accum,
+        global uint *rng,
+        uint samples) {
     const uint x_coord = get_global_id(0);
     const uint y_coord = get_global_id(1);
     const uint resX = get_global_size(0);
     const uint resY = get_global_size(1);
+    const int pixel = y_coord * resX + x_coord;
+    uint seed = load_seed(rng, pixel);
+    Ray r = pixel_ray(cam, x_coord, y_coord, resX, resY, &seed);
+    color radiance = trace_path(r, SCENE_ARGS, &seed);
+    finish_path(accum, rng, samples, pixel, radiance, seed);
+}
+
+/* Write the mean of each pixel's accumulated samples to the display image,
+ * clamped to the range it can show.
+ */
+kernel void
+tonemap(write_only image2d_t image, global color4 *accum) {
+    const uint x_coord = get_global_id(0);
+    const uint y_coord = get_global_id(1);
+    color4 sum = accum[y_coord * get_global_size(0) + x_coord];
     write_imagef(image, (int2){
             x_coord, y_coord
     }, (color4){
-        0, 1, 0, 1
+            clamp(sum.xyz / sum.w, 0.0f, 1.0f), 1.0
     });
-    const vec3 origin = new_vec3(cam[0].z / cam[3].z,
-            cam[1].z / cam[3].z,
-            cam[2].z / cam[3].z);
+}
 
-    const vec3 ncp = mul(cam,
-            new_vec3(x_coord - (vec_t)resX / 2, y_coord - (vec_t)resY / 2, -1)
+/* The wavefront pipeline splits render() into one kernel per stage, each
+ * run over a queue in global memory, so that a stage's work-items all do
+ * the same kind of work: generate() writes a camera ray per pixel,
+ * extend() traces every queued ray, ending paths that miss and compacting
+ * hits into a hit queue, and shade() runs over just the hits, compacting
+ * the paths that go on into the next ray queue. CLState.c alternates
+ * extend() and shade() until no paths are left, then runs tonemap().
+ */
+
+/* A path waiting in a ray queue: its next ray, the pixel it renders, and
+ * the state trace_path() keeps in registers. Mirrors PathRay in CLState.c.
+ */
+typedef struct PathRay {
+    vec4 orig, dir;
+    color4 radiance, throughput;
+    int pixel;
+    int depth;
+    uint seed;
+} PathRay;
+
+/* A ray of the ray queue that hit something. Mirrors PathHit in CLState.c.
+ */
+typedef struct PathHit {
+    TriHit hit;
+    int ray;
+} PathHit;
+
+// Queue counters: hits found by extend(), and paths shade() continues.
+#define COUNT_HITS 0
+#define COUNT_RAYS 1
 
-    );
-    const vec3 fcp = mul(cam,
-            new_vec3(x_coord - (vec_t)resX / 2, y_coord - (vec_t)resY / 2, 1)
+kernel void
+generate(global vec4 cam[4], global PathRay *rays, global uint *rng) {
+    const uint x_coord = get_global_id(0);
+    const uint y_coord = get_global_id(1);
+    const uint resX = get_global_size(0);
+    const uint resY = get_global_size(1);
+    const int pixel = y_coord * resX + x_coord;
+    uint seed = load_seed(rng, pixel);
+    Ray r = pixel_ray(cam, x_coord, y_coord, resX, resY, &seed);
+    rays[pixel] = (PathRay){
+            (vec4)(r.orig, 0),
+            (vec4)(r.dir, 0),
+            (color4)(0),
+            (color4)(1),
+            pixel,
+            0,
+            seed
+    };
+}
 
-    );
-    const vec3 dir = normalize((fcp - ncp).xyz);
-    Ray r = new_Ray(origin, dir);
-    write_imagef(image, (int2){
-            x_coord, y_coord
-    }, (color4){
-            trace_ray(r,
-                    objects,
-                    objcount,
-                    verts,
-                    norms,
-                    tris,
-                    tri_indices,
-                    kd_tree,
-                    2,
-                    0,
-                    1.0,
-                    x_coord == resX / 2 && y_coord == resY / 2), 1.0
-    });
+kernel void
+extend(SCENE_PARAMS,
+        global PathRay *rays,
+        global PathHit *hits,
+        global uint *counts,
+        global color4 *accum,
+        global uint *rng,
+        uint samples) {
+    const int id = get_global_id(0);
+    PathRay path = rays[id];
+    Ray r = new_Ray(path.orig.xyz, path.dir.xyz);
+    TriHit hit;
+    if (intersect_scene(SCENE_ARGS, r, &hit)) {
+        hits[atomic_inc(&counts[COUNT_HITS])] = (PathHit){
+                hit, id
+        };
+    } else {
+        finish_path(accum,
+                rng,
+                samples,
+                path.pixel,
+                path_miss(path.radiance.xyz, path.throughput.xyz),
+                path.seed);
+    }
+}
+
+kernel void
+shade(SCENE_PARAMS,
+        global PathRay *rays,
+        global PathHit *hits,
+        global PathRay *next_rays,
+        global uint *counts,
+        global color4 *accum,
+        global uint *rng,
+        uint samples) {
+    PathHit entry = hits[get_global_id(0)];
+    PathRay path = rays[entry.ray];
+    Ray r = new_Ray(path.orig.xyz, path.dir.xyz);
+    color radiance = path.radiance.xyz, throughput = path.throughput.xyz;
+    if (!path_hit(SCENE_ARGS,
+            entry.hit,
+            path.depth,
+            &r,
+            &radiance,
+            &throughput,
+            &path.seed)) {
+        finish_path(accum, rng, samples, path.pixel, radiance, path.seed);
+        return;
+    }
+    next_rays[atomic_inc(&counts[COUNT_RAYS])] = (PathRay){
+            (vec4)(r.orig, 0),
+            (vec4)(r.dir, 0),
+            (color4)(radiance, 0),
+            (color4)(throughput, 0),
+            path.pixel,
+            path.depth + 1,
+            path.seed
+    };
 }
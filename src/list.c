@@ -2,9 +2,11 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "list.h"
+
 typedef struct data data;
 
-size_t LIST_INDEX;
+_Thread_local size_t LIST_INDEX;
 
 struct data {
     size_t capacity;
@@ -12,6 +14,8 @@ struct data {
     char data[];
 };
 
+_Static_assert(sizeof(data) == LIST_HEADER_SIZE, "list header size");
+
 static data *
 get_list(void *list) {
     data *l = list;
@@ -60,6 +64,15 @@ copy_list(const void *list) {
     return copy;
 }
 
+void *
+wrap_list(void *buffer, size_t size) {
+    data *l = get_list(buffer);
+    *l = (data){
+            size, size
+    };
+    return l->data;
+}
+
 void
 delete_list(void *list) {
     if (list == NULL) {
@@ -109,3 +122,13 @@ list_size(const void *list) {
     const data *l = get_const_list(list);
     return l->length;
 }
+
+void
+list_resize(void **list_ptr, size_t size) {
+    data *l = get_list(*list_ptr);
+    if (size > l->capacity) {
+        list_realloc(&l, l->capacity * 2 + size);
+    }
+    l->length = size;
+    *list_ptr = l->data;
+}
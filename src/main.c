@@ -1,20 +1,200 @@
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "game.h"
 #include "list.h"
+#include "model.h"
+#include "thread_pool.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
 
 #define KERNEL_FILENAME "src/kernel.cl"
 #define KERNEL_NAME "render"
+#define STREAM_BLOCK_MB 4
+
+static void
+usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options] model...\n", program);
+    fprintf(stderr, "Options apply to every model that follows them:\n");
+    fprintf(stderr, "\t--accel=kd|bvh\t\tacceleration structure\n");
+    fprintf(stderr, "\t--builder=binned|sweep\tkd-tree construction method\n");
+    fprintf(stderr, "\t--bins=N\t\tbins per axis for the binned builder\n");
+    fprintf(stderr, "\t--clip\t\t\tclip triangles to kd-tree nodes\n");
+    fprintf(stderr, "\t--traverse-cost=X\tnode visit cost per intersection\n");
+    fprintf(stderr, "\t--empty-bonus=X\t\tdiscount for empty children\n");
+    fprintf(stderr, "\t--max-depth=N\t\tkd-tree depth limit, 0 for auto\n");
+    fprintf(stderr, "\t--refit-limit=X\t\tcost growth before a BVH rebuild\n");
+    fprintf(stderr, "\t--weld=X\t\tmerge vertices closer than X\n");
+    fprintf(stderr, "\t--threads=N\t\tthreads used to load models\n");
+    fprintf(stderr, "\t--cache=DIR\t\tdirectory of cached trees\n");
+    fprintf(stderr, "\t--no-cache\t\talways rebuild trees\n");
+    fprintf(stderr, "\t--verify-cache\t\tchecksum whole trees on load\n");
+    fprintf(stderr, "\t--stream[=MB]\t\tread OBJ files in MB blocks\n");
+    fprintf(stderr, "\t--compress\t\tstore vertices compactly on the GPU\n");
+    fprintf(stderr, "\t--mailbox=N\t\tskip the last N triangles tested\n");
+    fprintf(stderr, "\t--stats\t\t\tprint triangle test counts\n");
+    fprintf(stderr, "\t--wavefront\t\trender with one kernel per stage\n");
+    fprintf(stderr, "\t--depth=N\t\tmost segments in a light path\n");
+    fprintf(stderr, "These apply to the next model only:\n");
+    fprintf(stderr, "\t--translate=X,Y,Z\tmove the model\n");
+    fprintf(stderr, "\t--scale=S\t\tscale the model uniformly\n");
+    fprintf(stderr, "\t--rotate-y=DEG\t\trotate the model about the Y axis\n");
+    fprintf(stderr, "\t--deform=H\t\tripple the model's vertices\n");
+    fprintf(stderr, "A file named more than once is loaded once and "
+                    "instanced.\n");
+}
+
+/* Parse a single transform option, applying it after 'transform'. Returns 0
+ * on success, or 1 if the option is not a valid transform.
+ */
+static int
+parse_transform(const char *arg, Matrix *transform) {
+    Matrix step;
+    if (strncmp(arg, "--translate=", 12) == 0) {
+        float x, y, z;
+        if (sscanf(arg + 12, "%f,%f,%f", &x, &y, &z) != 3) {
+            return 1;
+        }
+        step = mat_translation(Vector3(x, y, z));
+    } else if (strncmp(arg, "--scale=", 8) == 0) {
+        vec_t factor = strtof(arg + 8, NULL);
+        if (factor == 0) {
+            return 1;
+        }
+        step = mat_scaling(factor);
+    } else if (strncmp(arg, "--rotate-y=", 11) == 0) {
+        step = mat_rotation_y(strtof(arg + 11, NULL) * (vec_t)M_PI / 180);
+    } else {
+        return 1;
+    }
+    *transform = mat_multiply(step, *transform);
+    return 0;
+}
+
+/* Parse a single "--name=value" argument into 'config' or 'render'. Returns
+ * 0 on success, or 1 if the option is not recognized.
+ */
+static int
+parse_option(const char *arg, kd_config *config, render_config *render) {
+    if (strcmp(arg, "--accel=kd") == 0) {
+        config->accel = ACCEL_KD;
+    } else if (strcmp(arg, "--accel=bvh") == 0) {
+        config->accel = ACCEL_BVH;
+    } else if (strcmp(arg, "--builder=binned") == 0) {
+        config->builder = KD_BUILD_BINNED;
+    } else if (strcmp(arg, "--builder=sweep") == 0) {
+        config->builder = KD_BUILD_SWEEP;
+    } else if (strncmp(arg, "--bins=", 7) == 0) {
+        config->bins = atoi(arg + 7);
+        if (config->bins < 2) {
+            return 1;
+        }
+    } else if (strcmp(arg, "--clip") == 0) {
+        config->clip = 1;
+    } else if (strncmp(arg, "--traverse-cost=", 16) == 0) {
+        config->traverse_cost = strtof(arg + 16, NULL);
+        if (config->traverse_cost <= 0) {
+            return 1;
+        }
+    } else if (strncmp(arg, "--empty-bonus=", 14) == 0) {
+        config->empty_bonus = strtof(arg + 14, NULL);
+        if (config->empty_bonus < 0 || config->empty_bonus >= 1) {
+            return 1;
+        }
+    } else if (strncmp(arg, "--max-depth=", 12) == 0) {
+        config->max_depth = atoi(arg + 12);
+        if (config->max_depth < 0) {
+            return 1;
+        }
+    } else if (strncmp(arg, "--refit-limit=", 14) == 0) {
+        config->refit_limit = strtof(arg + 14, NULL);
+        if (config->refit_limit < 1) {
+            return 1;
+        }
+    } else if (strncmp(arg, "--weld=", 7) == 0) {
+        config->weld = strtof(arg + 7, NULL);
+        if (config->weld < 0) {
+            return 1;
+        }
+    } else if (strncmp(arg, "--threads=", 10) == 0) {
+        char *end;
+        long threads = strtol(arg + 10, &end, 10);
+        if (end == arg + 10 || *end != '\0' || threads < 1 ||
+                threads > INT_MAX) {
+            return 1;
+        }
+        if (pool_init((int)threads)) {
+            fprintf(stderr, "Threads already started, ignoring %s\n", arg);
+        }
+    } else if (strncmp(arg, "--cache=", 8) == 0) {
+        SetModelCache(arg + 8);
+    } else if (strcmp(arg, "--no-cache") == 0) {
+        SetModelCache(NULL);
+    } else if (strcmp(arg, "--verify-cache") == 0) {
+        SetCacheVerification(1);
+    } else if (strcmp(arg, "--compress") == 0) {
+        render->compress = 1;
+    } else if (strncmp(arg, "--mailbox=", 10) == 0) {
+        render->mailbox = atoi(arg + 10);
+        if (render->mailbox < 0) {
+            return 1;
+        }
+    } else if (strcmp(arg, "--stats") == 0) {
+        render->stats = 1;
+    } else if (strcmp(arg, "--wavefront") == 0) {
+        render->wavefront = 1;
+    } else if (strncmp(arg, "--depth=", 8) == 0) {
+        render->max_depth = atoi(arg + 8);
+        if (render->max_depth < 1) {
+            return 1;
+        }
+    } else if (strcmp(arg, "--stream") == 0) {
+        SetModelStreaming(STREAM_BLOCK_MB << 20);
+    } else if (strncmp(arg, "--stream=", 9) == 0) {
+        int block_mb = atoi(arg + 9);
+        if (block_mb <= 0) {
+            return 1;
+        }
+        SetModelStreaming((size_t)block_mb << 20);
+    } else {
+        return 1;
+    }
+    return 0;
+}
 
 int
 main(int argc, char **argv) {
-    const char **models = new_list(((size_t)argc - 1) * sizeof(*models));
+    ModelSpec *models = new_list(((size_t)argc - 1) * sizeof(*models));
+    kd_config config = KD_CONFIG_DEFAULT;
+    render_config render = RENDER_CONFIG_DEFAULT;
+    Matrix transform = Matrix_identity;
+    vec_t deform = 0;
     for (int i = 1; i < argc; i++) {
-        vector_append(models, argv[i]);
+        if (strncmp(argv[i], "--", 2) != 0) {
+            vector_append(models, ((ModelSpec){
+                    argv[i], config, transform, deform
+            }));
+            transform = Matrix_identity;
+            deform = 0;
+        } else if (strncmp(argv[i], "--deform=", 9) == 0) {
+            deform = strtof(argv[i] + 9, NULL);
+        } else if (parse_transform(argv[i], &transform) &&
+                parse_option(argv[i], &config, &render)) {
+            fprintf(stderr, "Unrecognized option: \"%s\"\n", argv[i]);
+            usage(argv[0]);
+            delete_list(models);
+            return EXIT_FAILURE;
+        }
     }
-    GameInit(KERNEL_FILENAME, KERNEL_NAME, models);
+    GameInit(KERNEL_FILENAME, KERNEL_NAME, models, &render);
     delete_list(models);
     StartGameLoop();
     GameTerminate();
+    pool_terminate();
     return 0;
 }
@@ -1,3 +1,5 @@
+#include <math.h>
+
 #include "matrix.h"
 
 #define index(M, i) M.rows[i / 4].s[i % 4]
@@ -170,3 +172,42 @@ mat_inverse(Matrix m, int *err) {
     mat_scale(&inv, det);
     return inv;
 }
+
+Matrix
+mat_translation(Vector3 offset) {
+    return Matrix(
+            1, 0, 0, vec_x(offset),
+            0, 1, 0, vec_y(offset),
+            0, 0, 1, vec_z(offset),
+            0, 0, 0, 1);
+}
+
+Matrix
+mat_scaling(vec_t factor) {
+    return Matrix(
+            factor, 0, 0, 0,
+            0, factor, 0, 0,
+            0, 0, factor, 0,
+            0, 0, 0, 1);
+}
+
+Matrix
+mat_rotation_y(vec_t radians) {
+    vec_t c = cosf(radians), s = sinf(radians);
+    return Matrix(
+            c, 0, s, 0,
+            0, 1, 0, 0,
+            -s, 0, c, 0,
+            0, 0, 0, 1);
+}
+
+Vector3
+mat_transform_point(Matrix mat, Vector3 v) {
+    vec_t out[4];
+    for (int i = 0; i < 4; i++) {
+        Vector4 row = mat.rows[i];
+        out[i] = row.s[0] * vec_x(v) + row.s[1] * vec_y(v) +
+                row.s[2] * vec_z(v) + row.s[3];
+    }
+    return Vector3(out[0] / out[3], out[1] / out[3], out[2] / out[3]);
+}
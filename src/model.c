@@ -1,17 +1,18 @@
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 
 #include "vector.h"
 #include "model.h"
+#include "obj.h"
+#include "ply.h"
 #include "list.h"
-
-#define TINYOBJ_LOADER_C_IMPLEMENTATION
-#include "tinyobj_loader_c.h"
+#include "util.h"
+#include "weld.h"
 
 enum model_type {
-    MODEL_OBJ, MODEL_KD, MODEL_NONE
+    MODEL_OBJ, MODEL_PLY, MODEL_KD, MODEL_NONE
 };
 
 struct filetype {
@@ -20,19 +21,23 @@ struct filetype {
 } filetypes[] = {
         {
                 ".obj", MODEL_OBJ
+        }, {
+                ".ply", MODEL_PLY
         }, {
                 ".kd", MODEL_KD
         }
 };
 
+// Directory of cached trees, or NULL to always rebuild.
+static const char *cache_dir = ".kdcache";
+// Bytes read at a time when streaming OBJ files, or 0 to map them whole.
+static size_t stream_block_size = 0;
+static int verify_cache = 0;
+
 static enum model_type
-get_filetype(const char *filename, char **path) {
+get_filetype(const char *filename) {
     const char *ext = strrchr(filename, '.');
     if (ext) {
-        if (path) {
-            *path = calloc(ext - filename + 1, 1);
-            strncpy(*path, filename, ext - filename);
-        }
         for (size_t i = 0; i < sizeof(filetypes) / sizeof(*filetypes); i++) {
             if (strcmp(ext, filetypes[i].ext) == 0) {
                 return filetypes[i].type;
@@ -42,123 +47,198 @@ get_filetype(const char *filename, char **path) {
     return MODEL_NONE;
 }
 
-static size_t
-file_length(FILE *file) {
-    long int length, prev_pos;
+/* Parses a mapped mesh file into new vertex, normal and triangle lists. */
+typedef int (*mesh_parser)(const char *data,
+        size_t len,
+        Vector3 **verts,
+        Vector3 **norms,
+        cl_int3 **tris);
 
-    prev_pos = ftell(file);
-    if (fseek(file, 0, SEEK_END) != 0) {
-        perror("fseek");
-        exit(EXIT_FAILURE);
+/* Seed for hashing a mesh file into a cache key, so that trees built with
+ * different configs are cached separately. Fields that don't affect the
+ * built tree are left out.
+ */
+static uint64_t
+cache_seed(const kd_config *config) {
+    kd_config key = *config;
+    key.refit_limit = 0;
+    return hash_data(&key, sizeof(key), 0);
+}
+
+/* Path of the cache entry for a mesh file with the given hash, or NULL if
+ * caching is disabled.
+ */
+static char *
+cache_path(uint64_t hash) {
+    if (cache_dir == NULL || make_directory(cache_dir)) {
+        return NULL;
     }
-    if ((length = ftell(file)) < 0) {
-        perror("ftell");
+    size_t size = snprintf(NULL, 0, "%s/%016" PRIx64 ".kd", cache_dir, hash);
+    char *path = malloc(size + 1);
+    if (path == NULL) {
+        perror("malloc");
         exit(EXIT_FAILURE);
     }
-    if (fseek(file, prev_pos, SEEK_SET) != 0) {
-        perror("fseek");
-        exit(EXIT_FAILURE);
+    sprintf(path, "%s/%016" PRIx64 ".kd", cache_dir, hash);
+    return path;
+}
+
+/* Load the tree cached at 'path', if there is a valid one. */
+static int
+load_cached(const char *path, kd *tree) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return 1;
     }
-    return length;
+    fclose(file);
+    long start = wall_clock_ms();
+    if (parse_kd(path, tree, verify_cache)) {
+        printf("Discarding cached kd-tree %s\n", path);
+        return 1;
+    }
+    printf("Loaded cached kd-tree %s in %ld ms.\n",
+            path,
+            wall_clock_ms() - start);
+    return 0;
 }
 
-static void
-read_file(char *buffer, size_t file_len, FILE *file) {
-    buffer[file_len] = '\0';
-    if (fread(buffer, 1, file_len, file) != file_len && ferror(file) != 0) {
-        fprintf(stderr, "error reading from file\n");
-        exit(EXIT_FAILURE);
+/* Weld a freshly parsed mesh file, build a tree over it and cache it at
+ * 'path'. Returns 0 on success, or 1 if welding left no triangles.
+ */
+static int
+build_mesh(const char *format,
+        Vector3 *verts,
+        Vector3 *norms,
+        cl_int3 *corners,
+        const kd_config *config,
+        char *path,
+        long start,
+        kd *tree) {
+    long end = wall_clock_ms();
+    printf("%s file parsed in %ld ms.\n", format, end - start);
+    start = wall_clock_ms();
+    int *sources;
+    cl_int4 *tris = weld_mesh(corners, &verts, &norms, &sources, config->weld);
+    end = wall_clock_ms();
+    if (vector_length(tris) == 0) {
+        fprintf(stderr, "%s file has no triangles after welding\n", format);
+        delete_list(tris);
+        delete_list(verts);
+        delete_list(norms);
+        delete_list(sources);
+        free(path);
+        return 1;
     }
+    printf("Mesh welded in %ld ms. Building kd-tree...\n", end - start);
+    start = wall_clock_ms();
+    *tree = build_kd(tris, verts, norms, sources, config, path);
+    end = wall_clock_ms();
+    printf("kd-tree built in %ld ms.\n", end - start);
+    free(path);
+    return 0;
 }
 
+/* Map the whole file and parse it with 'parse'. */
 static int
-tinyOBJ_parse(const char *filename, const char *path, kd *tree) {
-    printf("Parsing OBJ file...\n");
-    clock_t start = clock();
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        perror(filename);
+load_mapped(const char *filename,
+        const char *format,
+        mesh_parser parse,
+        const kd_config *config,
+        kd *tree) {
+    long start = wall_clock_ms();
+    size_t len;
+    char *data = map_file(filename, &len);
+    if (data == NULL) {
         return 1;
     }
-    size_t len = file_length(file);
-    char *file_buffer = malloc(len + 1);
-    if (file_buffer == NULL) {
-        perror("malloc");
-        exit(EXIT_FAILURE);
+    char *path = cache_path(hash_data(data, len, cache_seed(config)));
+    if (path != NULL && !load_cached(path, tree)) {
+        free(path);
+        unmap_file(data, len);
+        return 0;
     }
-    read_file(file_buffer, len, file);
-    fclose(file);
-    unsigned int flags = TINYOBJ_FLAG_TRIANGULATE;
-    tinyobj_attrib_t attrib;
-    tinyobj_shape_t *shapes = NULL;
-    size_t num_shapes;
-    tinyobj_material_t *materials = NULL;
-    size_t num_materials;
-    int ret = tinyobj_parse_obj(&attrib,
-            &shapes,
-            &num_shapes,
-            &materials,
-            &num_materials,
-            file_buffer,
-            len,
-            flags);
-    free(file_buffer);
-    if (ret != TINYOBJ_SUCCESS) {
+    printf("Parsing %s file...\n", format);
+    Vector3 *verts, *norms;
+    cl_int3 *tris;
+    int ret = parse(data, len, &verts, &norms, &tris);
+    unmap_file(data, len);
+    if (ret) {
+        fprintf(stderr, "Failed to parse %s\n", filename);
+        free(path);
         return 1;
     }
-    Vector3 *verts = new_list(sizeof(*verts) * attrib.num_vertices);
-    for (unsigned int i = 0; i < attrib.num_vertices; i++) {
-        vector_append(verts,
-                Vector3(attrib.vertices[3 * i + 0],
-                        attrib.vertices[3 * i + 1],
-                        attrib.vertices[3 * i + 2]));
+    return build_mesh(format, verts, norms, tris, config, path, start, tree);
+}
+
+/* Read the file twice a block at a time: once to hash it and size the
+ * lists, and once to parse it, so the whole text is never in memory.
+ */
+static int
+stream_obj_file(const char *filename, const kd_config *config, kd *tree) {
+    long start = wall_clock_ms();
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        perror(filename);
+        return 1;
     }
-    cl_int3 *tris = new_list(sizeof(*tris) * attrib.num_faces);
-    for (unsigned int i = 0; i < attrib.num_faces; i++) {
-        vector_append(tris, ((cl_int3){
-                {
-                        attrib.faces[i].v_idx,
-                        attrib.faces[i].vn_idx,
-                        attrib.faces[i].vt_idx
-                }
-        }));
+    hash_state hash;
+    hash_init(&hash, cache_seed(config));
+    obj_counts counts;
+    if (scan_obj(file, stream_block_size, &hash, &counts)) {
+        fclose(file);
+        return 1;
     }
-    Vector3 *norms = new_list(sizeof(*norms) * attrib.num_normals);
-    for (unsigned int i = 0; i < attrib.num_normals; i++) {
-        vector_append(norms,
-                Vector3(attrib.normals[3 * i + 0],
-                        attrib.normals[3 * i + 1],
-                        attrib.normals[3 * i + 2]));
+    char *path = cache_path(hash_final(&hash));
+    if (path != NULL && !load_cached(path, tree)) {
+        free(path);
+        fclose(file);
+        return 0;
     }
-    tinyobj_attrib_free(&attrib);
-    tinyobj_shapes_free(shapes, num_shapes);
-    tinyobj_materials_free(materials, num_materials);
-    clock_t end = clock();
-    printf("OBJ file parsed in %ld ms. Building kd-tree...\n",
-            (end - start) * 1000 / CLOCKS_PER_SEC);
-    start = clock();
-    *tree = build_kd(tris, verts, norms, path);
-    end = clock();
-    printf("kd-tree built in %ld ms.\n",
-            (end - start) * 1000 / CLOCKS_PER_SEC);
-    return 0;
+    printf("Streaming OBJ file...\n");
+    rewind(file);
+    Vector3 *verts, *norms;
+    cl_int3 *tris;
+    int ret = stream_obj(file,
+            stream_block_size,
+            &counts,
+            &verts,
+            &norms,
+            &tris);
+    fclose(file);
+    if (ret) {
+        fprintf(stderr, "Failed to parse %s\n", filename);
+        free(path);
+        return 1;
+    }
+    return build_mesh("OBJ", verts, norms, tris, config, path, start, tree);
 }
 
-int
-LoadModel(const char *filename, kd *tree) {
-    char *path = NULL;
-    switch (get_filetype(filename, &path)) {
-        case MODEL_OBJ:;
-            int ret;
-            if (tinyOBJ_parse(filename, path, tree)) {
-                ret = 1;
-            } else {
-                ret = 0;
-            }
-            free(path);
-            return ret;
+void
+SetModelCache(const char *dir) {
+    cache_dir = dir;
+}
+
+void
+SetModelStreaming(size_t block_size) {
+    stream_block_size = block_size;
+}
+
+void
+SetCacheVerification(int verify) {
+    verify_cache = verify;
+}
+
+static int
+load_file(const char *filename, const kd_config *config, kd *tree) {
+    switch (get_filetype(filename)) {
+        case MODEL_OBJ:
+            return stream_block_size > 0
+                    ? stream_obj_file(filename, config, tree)
+                    : load_mapped(filename, "OBJ", parse_obj, config, tree);
+        case MODEL_PLY:
+            return load_mapped(filename, "PLY", parse_ply, config, tree);
         case MODEL_KD:
-            return parse_kd(filename, tree);
+            return parse_kd(filename, tree, verify_cache);
         default:
             fprintf(stderr, "Unrecognized filetype: \"%s\"\n", filename);
             fprintf(stderr, "Supported filetypes are: ");
@@ -170,7 +250,15 @@ LoadModel(const char *filename, kd *tree) {
                 sep = ", ";
             }
             fprintf(stderr, "\n");
-            free(path);
             return 1;
     }
 }
+
+int
+LoadModel(const char *filename, const kd_config *config, kd *tree) {
+    if (load_file(filename, config, tree)) {
+        return 1;
+    }
+    printf("Peak RSS after loading %s: %ld MB\n", filename, peak_rss_mb());
+    return 0;
+}
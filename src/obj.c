@@ -0,0 +1,579 @@
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "list.h"
+#include "obj.h"
+#include "thread_pool.h"
+
+// Inputs are split into chunks of at least this many bytes, with up to
+// OBJ_CHUNKS_PER_THREAD chunks per pool thread so that threads finishing
+// early can take more.
+#define OBJ_MIN_CHUNK (1 << 20)
+#define OBJ_CHUNKS_PER_THREAD 4
+
+/* Element types, in the order triangle corners store their indices. */
+typedef enum OBJ_ELEMENT {
+    OBJ_V = 0, OBJ_VN = 1, OBJ_VT = 2
+} OBJ_ELEMENT;
+
+/* One triangle corner as written in the file. A relative (negative) index
+ * is resolved against the elements parsed so far in its own chunk, and
+ * flagged in 'relative' so that the counts of earlier chunks can be added
+ * once they are known.
+ */
+typedef struct obj_corner {
+    int index[3];
+    int relative;
+} obj_corner;
+
+typedef struct obj_output {
+    Vector3 *verts;
+    Vector3 *norms;
+    cl_int3 *tris;
+    int totals[3];
+} obj_output;
+
+/* The elements of one line-aligned range of the file, and where they go in
+ * the output once every chunk has been parsed.
+ */
+typedef struct obj_chunk {
+    const char *begin, *end;
+    Vector3 *verts;
+    Vector3 *norms;
+    obj_corner *corners;
+    int counts[3];
+    size_t lines;
+    size_t error_line;
+    obj_output *out;
+    int offsets[3];
+    size_t corner_offset;
+    int used[3];
+    int bad_index;
+} obj_chunk;
+
+/* A whole file parsed as one chunk a block at a time, with its triangles
+ * resolved as each block finishes.
+ */
+typedef struct obj_stream {
+    obj_chunk chunk;
+    cl_int3 *tris;
+} obj_stream;
+
+typedef int (*obj_block_func)(void *ctx, const char *begin, const char *end);
+
+static int
+is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static const char *
+skip_space(const char *p, const char *end) {
+    while (p < end && is_space(*p)) {
+        p++;
+    }
+    return p;
+}
+
+static int
+parse_int(const char **p, const char *end, int *value) {
+    const char *s = *p;
+    int negative = 0;
+    if (s < end && (*s == '-' || *s == '+')) {
+        negative = *s++ == '-';
+    }
+    if (s == end || *s < '0' || *s > '9') {
+        return 1;
+    }
+    long v = 0;
+    for (; s < end && *s >= '0' && *s <= '9'; s++) {
+        v = v * 10 + (*s - '0');
+        if (v > INT_MAX) {
+            return 1;
+        }
+    }
+    *value = negative
+            ? -(int)v
+            : (int)v;
+    *p = s;
+    return 0;
+}
+
+/* Parse a decimal float without strtof(), which needs the text to be NUL
+ * terminated and is slowed down by locale handling.
+ */
+static int
+parse_float(const char **p, const char *end, vec_t *value) {
+    static const double powers[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char *s = *p;
+    int negative = 0;
+    if (s < end && (*s == '-' || *s == '+')) {
+        negative = *s++ == '-';
+    }
+    double mantissa = 0;
+    int digits = 0, exponent = 0;
+    for (; s < end && *s >= '0' && *s <= '9'; s++, digits++) {
+        mantissa = mantissa * 10 + (*s - '0');
+    }
+    if (s < end && *s == '.') {
+        for (s++; s < end && *s >= '0' && *s <= '9'; s++, digits++) {
+            mantissa = mantissa * 10 + (*s - '0');
+            exponent--;
+        }
+    }
+    if (digits == 0) {
+        return 1;
+    }
+    if (s < end && (*s == 'e' || *s == 'E')) {
+        int e;
+        s++;
+        if (parse_int(&s, end, &e)) {
+            return 1;
+        }
+        // Far beyond the range of a float, and keeps the sum from
+        // overflowing.
+        exponent += e < -400
+                ? -400
+                : e > 400
+                        ? 400
+                        : e;
+    }
+    if (mantissa == 0) {
+        *value = negative
+                ? -0.0f
+                : 0.0f;
+        *p = s;
+        return 0;
+    }
+    int magnitude = abs(exponent);
+    double scale = magnitude < (int)(sizeof(powers) / sizeof(*powers))
+            ? powers[magnitude]
+            : pow(10, magnitude);
+    double v = exponent < 0
+            ? mantissa / scale
+            : mantissa * scale;
+    *value = (vec_t)(negative
+            ? -v
+            : v);
+    *p = s;
+    return 0;
+}
+
+static int
+parse_vec(const char *p, const char *end, Vector3 **vec) {
+    Vector3 v = Vector3_zero;
+    for (int i = 0; i < 3; i++) {
+        p = skip_space(p, end);
+        if (parse_float(&p, end, &v.s[i])) {
+            return 1;
+        }
+    }
+    vector_append(*vec, v);
+    return 0;
+}
+
+/* Parse one of the forms "v", "v/vt", "v//vn" or "v/vt/vn". */
+static int
+parse_corner(const obj_chunk *chunk,
+        const char **p,
+        const char *end,
+        obj_corner *corner) {
+    static const OBJ_ELEMENT order[3] = { OBJ_V, OBJ_VT, OBJ_VN };
+    *corner = (obj_corner){
+            { -1, -1, -1 }, 0
+    };
+    const char *s = *p;
+    for (int i = 0; i < 3; i++) {
+        if (i > 0) {
+            if (s == end || *s != '/') {
+                break;
+            }
+            s++;
+            if (i == 1 && s < end && *s == '/') {
+                continue;
+            }
+        }
+        OBJ_ELEMENT type = order[i];
+        int value;
+        if (parse_int(&s, end, &value) || value == 0) {
+            return 1;
+        }
+        if (value < 0) {
+            corner->index[type] = chunk->counts[type] + value;
+            corner->relative |= 1 << type;
+        } else {
+            corner->index[type] = value - 1;
+        }
+    }
+    if (s < end && !is_space(*s)) {
+        return 1;
+    }
+    *p = s;
+    return 0;
+}
+
+/* Parse a polygon, appending it as a fan of triangles. */
+static int
+parse_face(obj_chunk *chunk, const char *p, const char *end) {
+    obj_corner first, prev, corner;
+    int count = 0;
+    for (p = skip_space(p, end); p < end; p = skip_space(p, end)) {
+        if (parse_corner(chunk, &p, end, &corner)) {
+            return 1;
+        }
+        if (count == 0) {
+            first = corner;
+        } else if (count >= 2) {
+            vector_append(chunk->corners, first);
+            vector_append(chunk->corners, prev);
+            vector_append(chunk->corners, corner);
+        }
+        prev = corner;
+        count++;
+    }
+    return count < 3;
+}
+
+static int
+parse_line(obj_chunk *chunk, const char *p, const char *end) {
+    p = skip_space(p, end);
+    if (p == end || *p == '#') {
+        return 0;
+    }
+    const char *word = p;
+    while (p < end && !is_space(*p)) {
+        p++;
+    }
+    size_t len = p - word;
+    if (len == 1 && word[0] == 'v') {
+        chunk->counts[OBJ_V]++;
+        return parse_vec(p, end, &chunk->verts);
+    } else if (len == 2 && word[0] == 'v' && word[1] == 'n') {
+        chunk->counts[OBJ_VN]++;
+        return parse_vec(p, end, &chunk->norms);
+    } else if (len == 2 && word[0] == 'v' && word[1] == 't') {
+        chunk->counts[OBJ_VT]++;
+    } else if (len == 1 && word[0] == 'f') {
+        return parse_face(chunk, p, end);
+    }
+    return 0;
+}
+
+static void
+parse_chunk(void *arg) {
+    obj_chunk *chunk = arg;
+    const char *p = chunk->begin, *end = chunk->end;
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (eol == NULL) {
+            eol = end;
+        }
+        chunk->lines++;
+        if (parse_line(chunk, p, eol)) {
+            chunk->error_line = chunk->lines;
+            return;
+        }
+        p = eol < end
+                ? eol + 1
+                : end;
+    }
+}
+
+/* Write a chunk's corners to 'tris', offsetting their relative indices by
+ * the elements of the chunks before it. The indices referenced are noted in
+ * 'used' to be checked once the number of elements is known.
+ */
+static void
+resolve_corners(obj_chunk *chunk, cl_int3 *tris) {
+    size_t count = vector_length(chunk->corners);
+    for (size_t i = 0; i < count; i++) {
+        const obj_corner *corner = &chunk->corners[i];
+        for (int type = 0; type < 3; type++) {
+            int index = corner->index[type];
+            if (corner->relative & 1 << type) {
+                index += chunk->offsets[type];
+            } else if (index == -1 && type != OBJ_V) {
+                tris[i].s[type] = -1;
+                continue;
+            }
+            if (index < 0) {
+                chunk->bad_index = 1;
+            } else if (index >= chunk->used[type]) {
+                chunk->used[type] = index + 1;
+            }
+            tris[i].s[type] = index;
+        }
+    }
+}
+
+static int
+check_indices(const obj_chunk *chunk, const int totals[3]) {
+    if (chunk->bad_index || chunk->used[OBJ_V] > totals[OBJ_V] ||
+            chunk->used[OBJ_VN] > totals[OBJ_VN] ||
+            chunk->used[OBJ_VT] > totals[OBJ_VT]) {
+        fprintf(stderr, "OBJ face index out of range\n");
+        return 1;
+    }
+    return 0;
+}
+
+/* Copy a parsed chunk into its place in the output. */
+static void
+merge_chunk(void *arg) {
+    obj_chunk *chunk = arg;
+    obj_output *out = chunk->out;
+    memcpy(out->verts + chunk->offsets[OBJ_V],
+            chunk->verts,
+            list_size(chunk->verts));
+    memcpy(out->norms + chunk->offsets[OBJ_VN],
+            chunk->norms,
+            list_size(chunk->norms));
+    resolve_corners(chunk, out->tris + chunk->corner_offset);
+}
+
+static void
+delete_chunk(obj_chunk *chunk) {
+    delete_list(chunk->verts);
+    delete_list(chunk->norms);
+    delete_list(chunk->corners);
+}
+
+int
+parse_obj(const char *data,
+        size_t len,
+        Vector3 **verts,
+        Vector3 **norms,
+        cl_int3 **tris) {
+    size_t chunk_count = (size_t)pool_size() * OBJ_CHUNKS_PER_THREAD;
+    if (chunk_count > len / OBJ_MIN_CHUNK + 1) {
+        chunk_count = len / OBJ_MIN_CHUNK + 1;
+    }
+    obj_chunk *chunks = calloc(chunk_count, sizeof(*chunks));
+    if (chunks == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    const char *p = data, *end = data + len;
+    task_group group = TASK_GROUP_INIT;
+    for (size_t i = 0; i < chunk_count; i++) {
+        const char *target = data + len / chunk_count * (i + 1);
+        const char *eol = i + 1 < chunk_count && target > p
+                ? memchr(target, '\n', end - target)
+                : NULL;
+        chunks[i].begin = p;
+        chunks[i].end = p = eol != NULL
+                ? eol + 1
+                : i + 1 < chunk_count
+                        ? p
+                        : end;
+        chunks[i].verts = new_list(0);
+        chunks[i].norms = new_list(0);
+        chunks[i].corners = new_list(0);
+        pool_submit(&group, parse_chunk, &chunks[i]);
+    }
+    pool_wait(&group);
+
+    obj_output out = { 0 };
+    size_t lines = 0, corner_count = 0;
+    int failed = 0;
+    for (size_t i = 0; i < chunk_count && !failed; i++) {
+        obj_chunk *chunk = &chunks[i];
+        if (chunk->error_line != 0) {
+            fprintf(stderr,
+                    "Malformed OBJ line %zu\n",
+                    lines + chunk->error_line);
+            failed = 1;
+        }
+        lines += chunk->lines;
+        for (int type = 0; type < 3; type++) {
+            chunk->offsets[type] = out.totals[type];
+            out.totals[type] += chunk->counts[type];
+        }
+        chunk->corner_offset = corner_count;
+        corner_count += vector_length(chunk->corners);
+        chunk->out = &out;
+    }
+    if (!failed) {
+        out.verts = init_list(out.totals[OBJ_V], sizeof(*out.verts));
+        out.norms = init_list(out.totals[OBJ_VN], sizeof(*out.norms));
+        out.tris = init_list(corner_count, sizeof(*out.tris));
+        for (size_t i = 0; i < chunk_count; i++) {
+            pool_submit(&group, merge_chunk, &chunks[i]);
+        }
+        pool_wait(&group);
+        for (size_t i = 0; i < chunk_count && !failed; i++) {
+            failed = check_indices(&chunks[i], out.totals);
+        }
+    }
+    for (size_t i = 0; i < chunk_count; i++) {
+        delete_chunk(&chunks[i]);
+    }
+    free(chunks);
+    if (failed) {
+        delete_list(out.verts);
+        delete_list(out.norms);
+        delete_list(out.tris);
+        return 1;
+    }
+    *verts = out.verts;
+    *norms = out.norms;
+    *tris = out.tris;
+    return 0;
+}
+
+/* Read 'file' a block at a time, passing each run of complete lines to
+ * 'func' and carrying a partial last line over to the next block. The
+ * buffer only grows if a single line is longer than it.
+ */
+static int
+read_blocks(FILE *file,
+        size_t block_size,
+        hash_state *hash,
+        obj_block_func func,
+        void *ctx) {
+    size_t capacity = block_size, carry = 0;
+    char *buffer = malloc(capacity);
+    if (buffer == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    int ret = 0;
+    while (!ret) {
+        if (carry == capacity) {
+            capacity *= 2;
+            char *grown = realloc(buffer, capacity);
+            if (grown == NULL) {
+                free(buffer);
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            buffer = grown;
+        }
+        size_t got = fread(buffer + carry, 1, capacity - carry, file);
+        if (hash != NULL) {
+            hash_update(hash, buffer + carry, got);
+        }
+        size_t filled = carry + got;
+        if (got == 0) {
+            if (ferror(file)) {
+                perror("fread");
+                ret = 1;
+            } else if (filled > 0) {
+                ret = func(ctx, buffer, buffer + filled);
+            }
+            break;
+        }
+        size_t cut = filled;
+        while (cut > 0 && buffer[cut - 1] != '\n') {
+            cut--;
+        }
+        if (cut > 0) {
+            ret = func(ctx, buffer, buffer + cut);
+        }
+        carry = filled - cut;
+        memmove(buffer, buffer + cut, carry);
+    }
+    free(buffer);
+    return ret;
+}
+
+static void
+scan_line(obj_counts *counts, const char *p, const char *end) {
+    p = skip_space(p, end);
+    const char *word = p;
+    while (p < end && !is_space(*p)) {
+        p++;
+    }
+    size_t len = p - word;
+    if (len == 1 && word[0] == 'v') {
+        counts->verts++;
+    } else if (len == 2 && word[0] == 'v' && word[1] == 'n') {
+        counts->norms++;
+    } else if (len == 1 && word[0] == 'f') {
+        size_t corners = 0;
+        for (p = skip_space(p, end); p < end; p = skip_space(p, end)) {
+            while (p < end && !is_space(*p)) {
+                p++;
+            }
+            corners++;
+        }
+        if (corners >= 3) {
+            counts->corners += 3 * (corners - 2);
+        }
+    }
+}
+
+static int
+scan_block(void *ctx, const char *p, const char *end) {
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (eol == NULL) {
+            eol = end;
+        }
+        scan_line(ctx, p, eol);
+        p = eol < end
+                ? eol + 1
+                : end;
+    }
+    return 0;
+}
+
+int
+scan_obj(FILE *file, size_t block_size, hash_state *hash, obj_counts *counts) {
+    *counts = (obj_counts){ 0 };
+    return read_blocks(file, block_size, hash, scan_block, counts);
+}
+
+static int
+stream_block(void *ctx, const char *begin, const char *end) {
+    obj_stream *stream = ctx;
+    obj_chunk *chunk = &stream->chunk;
+    chunk->begin = begin;
+    chunk->end = end;
+    parse_chunk(chunk);
+    if (chunk->error_line != 0) {
+        fprintf(stderr, "Malformed OBJ line %zu\n", chunk->error_line);
+        return 1;
+    }
+    size_t count = vector_length(stream->tris);
+    vector_resize(stream->tris, count + vector_length(chunk->corners));
+    resolve_corners(chunk, stream->tris + count);
+    vector_resize(chunk->corners, 0);
+    return 0;
+}
+
+int
+stream_obj(FILE *file,
+        size_t block_size,
+        const obj_counts *counts,
+        Vector3 **verts,
+        Vector3 **norms,
+        cl_int3 **tris) {
+    obj_stream stream = {
+            .chunk = {
+                    .verts = new_list(counts->verts * sizeof(**verts)),
+                    .norms = new_list(counts->norms * sizeof(**norms)),
+                    .corners = new_list(0)
+            },
+            .tris = new_list(counts->corners * sizeof(**tris))
+    };
+    obj_chunk *chunk = &stream.chunk;
+    int failed = read_blocks(file, block_size, NULL, stream_block, &stream);
+    failed = failed || check_indices(chunk, chunk->counts);
+    delete_list(chunk->corners);
+    if (failed) {
+        delete_list(chunk->verts);
+        delete_list(chunk->norms);
+        delete_list(stream.tris);
+        return 1;
+    }
+    *verts = chunk->verts;
+    *norms = chunk->norms;
+    *tris = stream.tris;
+    return 0;
+}
@@ -0,0 +1,553 @@
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "list.h"
+#include "ply.h"
+
+// Longest element, property or type name accepted in a header.
+#define PLY_NAME_MAX 32
+// Longest header line accepted, other than comments.
+#define PLY_LINE_MAX 256
+
+typedef enum PLY_TYPE {
+    PLY_NONE,
+    PLY_INT8,
+    PLY_UINT8,
+    PLY_INT16,
+    PLY_UINT16,
+    PLY_INT32,
+    PLY_UINT32,
+    PLY_FLOAT32,
+    PLY_FLOAT64
+} PLY_TYPE;
+
+/* Type names, in both the original and the sized spellings. */
+static const struct ply_type_info {
+    const char *name, *alias;
+    size_t size;
+} ply_types[] = {
+        [PLY_NONE] = { "", "", 0 },
+        [PLY_INT8] = { "char", "int8", 1 },
+        [PLY_UINT8] = { "uchar", "uint8", 1 },
+        [PLY_INT16] = { "short", "int16", 2 },
+        [PLY_UINT16] = { "ushort", "uint16", 2 },
+        [PLY_INT32] = { "int", "int32", 4 },
+        [PLY_UINT32] = { "uint", "uint32", 4 },
+        [PLY_FLOAT32] = { "float", "float32", 4 },
+        [PLY_FLOAT64] = { "double", "float64", 8 }
+};
+
+typedef struct ply_property {
+    char name[PLY_NAME_MAX];
+    PLY_TYPE type;       // Value type, or item type of a list.
+    PLY_TYPE count_type; // Type of a list's length, or PLY_NONE if scalar.
+} ply_property;
+
+typedef struct ply_element {
+    char name[PLY_NAME_MAX];
+    size_t count;
+    ply_property *props;
+    int has_lists;
+    size_t stride; // Bytes per record, if it has no lists.
+} ply_element;
+
+typedef struct ply_file {
+    const unsigned char *p, *end;
+    int swap; // Nonzero if the file's byte order isn't the host's.
+    ply_element *elements;
+} ply_file;
+
+/* Offsets and types of the three scalar properties making up a vector, and
+ * whether they are floats stored back to back that can be copied as is.
+ */
+typedef struct ply_vec {
+    size_t offset[3];
+    PLY_TYPE type[3];
+    int packed;
+} ply_vec;
+
+static int
+host_is_little_endian(void) {
+    uint16_t one = 1;
+    unsigned char first;
+    memcpy(&first, &one, 1);
+    return first;
+}
+
+static PLY_TYPE
+find_type(const char *name) {
+    for (int type = PLY_INT8; type <= PLY_FLOAT64; type++) {
+        if (strcmp(name, ply_types[type].name) == 0 ||
+                strcmp(name, ply_types[type].alias) == 0) {
+            return type;
+        }
+    }
+    return PLY_NONE;
+}
+
+static int
+is_integer(PLY_TYPE type) {
+    return type != PLY_NONE && type < PLY_FLOAT32;
+}
+
+/* Copy 'size' bytes from 'src' to 'dst', reversing them if 'swap' is set. */
+static void
+read_bytes(void *dst, const unsigned char *src, size_t size, int swap) {
+    if (swap) {
+        unsigned char *d = dst;
+        for (size_t i = 0; i < size; i++) {
+            d[i] = src[size - 1 - i];
+        }
+    } else {
+        memcpy(dst, src, size);
+    }
+}
+
+static double
+read_value(const unsigned char *p, PLY_TYPE type, int swap) {
+    switch (type) {
+        case PLY_INT8: {
+            int8_t value;
+            read_bytes(&value, p, sizeof(value), swap);
+            return value;
+        }
+        case PLY_UINT8: {
+            uint8_t value;
+            read_bytes(&value, p, sizeof(value), swap);
+            return value;
+        }
+        case PLY_INT16: {
+            int16_t value;
+            read_bytes(&value, p, sizeof(value), swap);
+            return value;
+        }
+        case PLY_UINT16: {
+            uint16_t value;
+            read_bytes(&value, p, sizeof(value), swap);
+            return value;
+        }
+        case PLY_INT32: {
+            int32_t value;
+            read_bytes(&value, p, sizeof(value), swap);
+            return value;
+        }
+        case PLY_UINT32: {
+            uint32_t value;
+            read_bytes(&value, p, sizeof(value), swap);
+            return value;
+        }
+        case PLY_FLOAT32: {
+            float value;
+            read_bytes(&value, p, sizeof(value), swap);
+            return value;
+        }
+        case PLY_FLOAT64: {
+            double value;
+            read_bytes(&value, p, sizeof(value), swap);
+            return value;
+        }
+        default:
+            return 0;
+    }
+}
+
+static void
+delete_elements(ply_element *elements) {
+    for (size_t i = 0; i < vector_length(elements); i++) {
+        delete_list(elements[i].props);
+    }
+    delete_list(elements);
+}
+
+static int
+add_property(ply_file *ply, const char *line, ply_property prop) {
+    size_t count = vector_length(ply->elements);
+    if (count == 0 || prop.type == PLY_NONE ||
+            (prop.count_type != PLY_NONE && !is_integer(prop.count_type))) {
+        fprintf(stderr, "Malformed PLY header line \"%s\"\n", line);
+        return 1;
+    }
+    ply_element *elem = &ply->elements[count - 1];
+    if (prop.count_type != PLY_NONE) {
+        elem->has_lists = 1;
+    } else {
+        elem->stride += ply_types[prop.type].size;
+    }
+    vector_append(elem->props, prop);
+    return 0;
+}
+
+/* Parse one header line, adding any element or property it declares. */
+static int
+parse_header_line(ply_file *ply, const char *line) {
+    char format[PLY_NAME_MAX], type[PLY_NAME_MAX], count[PLY_NAME_MAX];
+    ply_element elem = { .props = NULL };
+    ply_property prop = { .count_type = PLY_NONE };
+    if (sscanf(line, "format %31s", format) == 1) {
+        if (strcmp(format, "binary_little_endian") == 0) {
+            ply->swap = !host_is_little_endian();
+        } else if (strcmp(format, "binary_big_endian") == 0) {
+            ply->swap = host_is_little_endian();
+        } else {
+            fprintf(stderr, "Unsupported PLY format \"%s\"\n", format);
+            return 1;
+        }
+        return 0;
+    }
+    if (sscanf(line, "element %31s %zu", elem.name, &elem.count) == 2) {
+        elem.props = new_list(0);
+        vector_append(ply->elements, elem);
+        return 0;
+    }
+    if (sscanf(line, "property list %31s %31s %31s", count, type, prop.name)
+            == 3) {
+        prop.count_type = find_type(count);
+        prop.type = find_type(type);
+        if (prop.count_type == PLY_NONE) {
+            prop.type = PLY_NONE;
+        }
+        return add_property(ply, line, prop);
+    }
+    if (sscanf(line, "property %31s %31s", type, prop.name) == 2) {
+        prop.type = find_type(type);
+        return add_property(ply, line, prop);
+    }
+    fprintf(stderr, "Malformed PLY header line \"%s\"\n", line);
+    return 1;
+}
+
+static int
+starts_with(const char *p, size_t len, const char *word) {
+    size_t n = strlen(word);
+    return len >= n && memcmp(p, word, n) == 0 &&
+            (len == n || p[n] == ' ');
+}
+
+/* Parse the text header, leaving ply->p at the first byte of the data. */
+static int
+parse_header(const char *data, size_t len, ply_file *ply) {
+    const char *p = data, *end = data + len;
+    for (size_t line = 0;; line++) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (eol == NULL) {
+            fprintf(stderr, "PLY header has no end_header line\n");
+            return 1;
+        }
+        size_t n = eol - p;
+        if (n > 0 && p[n - 1] == '\r') {
+            n--;
+        }
+        if (line == 0) {
+            if (n != 3 || memcmp(p, "ply", 3) != 0) {
+                fprintf(stderr, "Not a PLY file\n");
+                return 1;
+            }
+        } else if (starts_with(p, n, "end_header")) {
+            ply->p = (const unsigned char *)eol + 1;
+            break;
+        } else if (!starts_with(p, n, "comment") &&
+                !starts_with(p, n, "obj_info")) {
+            char buffer[PLY_LINE_MAX];
+            if (n >= PLY_LINE_MAX) {
+                fprintf(stderr, "PLY header line %zu is too long\n", line);
+                return 1;
+            }
+            memcpy(buffer, p, n);
+            buffer[n] = '\0';
+            if (parse_header_line(ply, buffer)) {
+                return 1;
+            }
+        }
+        p = eol + 1;
+    }
+    if (ply->swap < 0) {
+        fprintf(stderr, "PLY header has no format line\n");
+        return 1;
+    }
+    return 0;
+}
+
+static const ply_element *
+find_element(const ply_file *ply, const char *name) {
+    for (size_t i = 0; i < vector_length(ply->elements); i++) {
+        if (strcmp(ply->elements[i].name, name) == 0) {
+            return &ply->elements[i];
+        }
+    }
+    return NULL;
+}
+
+/* Find the scalar properties 'names' of an element without lists. */
+static int
+find_vec(const ply_element *elem,
+        const char *const names[3],
+        int swap,
+        ply_vec *vec) {
+    for (int i = 0; i < 3; i++) {
+        size_t offset = 0, j;
+        for (j = 0; j < vector_length(elem->props); j++) {
+            const ply_property *prop = &elem->props[j];
+            if (strcmp(prop->name, names[i]) == 0) {
+                break;
+            }
+            offset += ply_types[prop->type].size;
+        }
+        if (j == vector_length(elem->props)) {
+            return 1;
+        }
+        vec->offset[i] = offset;
+        vec->type[i] = elem->props[j].type;
+    }
+    size_t size = ply_types[PLY_FLOAT32].size;
+    vec->packed = !swap && sizeof(vec_t) == size;
+    for (int i = 0; i < 3; i++) {
+        vec->packed = vec->packed && vec->type[i] == PLY_FLOAT32 &&
+                vec->offset[i] == vec->offset[0] + i * size;
+    }
+    return 0;
+}
+
+static Vector3
+read_vec(const unsigned char *record, const ply_vec *vec, int swap) {
+    Vector3 v = Vector3_zero;
+    if (vec->packed) {
+        memcpy(v.s, record + vec->offset[0], 3 * sizeof(*v.s));
+        return v;
+    }
+    for (int i = 0; i < 3; i++) {
+        v.s[i] = read_value(record + vec->offset[i], vec->type[i], swap);
+    }
+    return v;
+}
+
+/* Index of the list property holding a face's vertex indices. */
+static int
+find_face_list(const ply_element *elem, size_t *index) {
+    for (size_t i = 0; i < vector_length(elem->props); i++) {
+        const ply_property *prop = &elem->props[i];
+        if ((strcmp(prop->name, "vertex_indices") == 0 ||
+                strcmp(prop->name, "vertex_index") == 0) &&
+                prop->count_type != PLY_NONE && is_integer(prop->type)) {
+            *index = i;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int
+truncated(void) {
+    fprintf(stderr, "PLY file is truncated\n");
+    return 1;
+}
+
+/* Advance '*p' past one record of 'elem', pointing 'items' and 'count' at
+ * the contents of its list property 'list'. Returns 1 if the record runs
+ * past the end of the file.
+ */
+static int
+next_record(const ply_file *ply,
+        const ply_element *elem,
+        size_t list,
+        const unsigned char **p,
+        const unsigned char **items,
+        size_t *count) {
+    const unsigned char *s = *p;
+    for (size_t i = 0; i < vector_length(elem->props); i++) {
+        const ply_property *prop = &elem->props[i];
+        size_t n = 1;
+        if (prop->count_type != PLY_NONE) {
+            size_t size = ply_types[prop->count_type].size;
+            if ((size_t)(ply->end - s) < size) {
+                return 1;
+            }
+            double value = read_value(s, prop->count_type, ply->swap);
+            if (value < 0) {
+                return 1;
+            }
+            n = value;
+            s += size;
+        }
+        if (i == list) {
+            *items = s;
+            *count = n;
+        }
+        size_t size = ply_types[prop->type].size;
+        if ((size_t)(ply->end - s) / size < n) {
+            return 1;
+        }
+        s += n * size;
+    }
+    *p = s;
+    return 0;
+}
+
+static int
+skip_element(ply_file *ply, const ply_element *elem) {
+    if (!elem->has_lists) {
+        if (elem->stride > 0 &&
+                (size_t)(ply->end - ply->p) / elem->stride < elem->count) {
+            return truncated();
+        }
+        ply->p += elem->count * elem->stride;
+        return 0;
+    }
+    for (size_t i = 0; i < elem->count; i++) {
+        if (next_record(ply, elem, SIZE_MAX, &ply->p, NULL, NULL)) {
+            return truncated();
+        }
+    }
+    return 0;
+}
+
+static int
+read_vertices(ply_file *ply,
+        const ply_element *elem,
+        const ply_vec *pos,
+        const ply_vec *norm,
+        Vector3 **verts,
+        Vector3 **norms) {
+    if ((size_t)(ply->end - ply->p) / elem->stride < elem->count) {
+        return truncated();
+    }
+    *verts = init_list(elem->count, sizeof(**verts));
+    *norms = init_list(norm != NULL
+            ? elem->count
+            : 0, sizeof(**norms));
+    for (size_t i = 0; i < elem->count; i++) {
+        const unsigned char *record = ply->p + i * elem->stride;
+        (*verts)[i] = read_vec(record, pos, ply->swap);
+        if (norm != NULL) {
+            (*norms)[i] = read_vec(record, norm, ply->swap);
+        }
+    }
+    ply->p += elem->count * elem->stride;
+    return 0;
+}
+
+/* Read the faces in two passes, first checking their records and counting
+ * triangles so that the triangle list can be allocated once.
+ */
+static int
+read_faces(ply_file *ply,
+        const ply_element *elem,
+        size_t list,
+        size_t vert_count,
+        int has_norms,
+        cl_int3 **tris) {
+    const unsigned char *p = ply->p, *items;
+    size_t tri_count = 0, count;
+    for (size_t i = 0; i < elem->count; i++) {
+        if (next_record(ply, elem, list, &p, &items, &count)) {
+            return truncated();
+        }
+        if (count < 3) {
+            fprintf(stderr, "PLY face %zu has fewer than 3 vertices\n", i);
+            return 1;
+        }
+        tri_count += count - 2;
+    }
+    PLY_TYPE type = elem->props[list].type;
+    size_t size = ply_types[type].size;
+    cl_int3 *out = init_list(3 * tri_count, sizeof(*out));
+    size_t corner = 0;
+    p = ply->p;
+    for (size_t i = 0; i < elem->count; i++) {
+        next_record(ply, elem, list, &p, &items, &count);
+        cl_int3 first, prev;
+        for (size_t j = 0; j < count; j++) {
+            double value = read_value(items + j * size, type, ply->swap);
+            if (value < 0 || value >= vert_count) {
+                fprintf(stderr, "PLY face index out of range\n");
+                delete_list(out);
+                return 1;
+            }
+            int index = value;
+            cl_int3 vertex = {
+                    { index, has_norms ? index : -1, -1 }
+            };
+            if (j == 0) {
+                first = vertex;
+            } else if (j >= 2) {
+                out[corner++] = first;
+                out[corner++] = prev;
+                out[corner++] = vertex;
+            }
+            prev = vertex;
+        }
+    }
+    ply->p = p;
+    *tris = out;
+    return 0;
+}
+
+int
+parse_ply(const char *data,
+        size_t len,
+        Vector3 **verts,
+        Vector3 **norms,
+        cl_int3 **tris) {
+    static const char *const pos_names[3] = { "x", "y", "z" };
+    static const char *const norm_names[3] = { "nx", "ny", "nz" };
+    ply_file ply = { .swap = -1 };
+    ply.elements = new_list(0);
+    if (parse_header(data, len, &ply)) {
+        delete_elements(ply.elements);
+        return 1;
+    }
+    ply.end = (const unsigned char *)data + len;
+    const ply_element *vertex = find_element(&ply, "vertex");
+    const ply_element *face = find_element(&ply, "face");
+    ply_vec pos, norm;
+    size_t list = 0;
+    int failed = 1;
+    if (vertex == NULL || face == NULL) {
+        fprintf(stderr, "PLY file has no vertex or face element\n");
+    } else if (vertex->has_lists ||
+            find_vec(vertex, pos_names, ply.swap, &pos)) {
+        fprintf(stderr, "PLY vertices need scalar x, y and z properties\n");
+    } else if (vertex->count > INT_MAX) {
+        fprintf(stderr, "PLY file has too many vertices\n");
+    } else if (find_face_list(face, &list)) {
+        fprintf(stderr, "PLY faces need a vertex_indices list\n");
+    } else {
+        failed = 0;
+    }
+    int has_norms = !failed && !find_vec(vertex, norm_names, ply.swap, &norm);
+    Vector3 *v = NULL, *n = NULL;
+    cl_int3 *t = NULL;
+    for (size_t i = 0; i < vector_length(ply.elements) && !failed; i++) {
+        const ply_element *elem = &ply.elements[i];
+        if (elem == vertex) {
+            failed = read_vertices(&ply,
+                    elem,
+                    &pos,
+                    has_norms ? &norm : NULL,
+                    &v,
+                    &n);
+        } else if (elem == face) {
+            failed = read_faces(&ply,
+                    elem,
+                    list,
+                    vertex->count,
+                    has_norms,
+                    &t);
+        } else {
+            failed = skip_element(&ply, elem);
+        }
+    }
+    delete_elements(ply.elements);
+    if (failed) {
+        delete_list(v);
+        delete_list(n);
+        delete_list(t);
+        return 1;
+    }
+    *verts = v;
+    *norms = n;
+    *tris = t;
+    return 0;
+}
@@ -0,0 +1,202 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "thread_pool.h"
+
+typedef struct task {
+    void (*func)(void *);
+    void *arg;
+    task_group *group;
+} task;
+
+static struct {
+    pthread_once_t once;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t *threads;
+    int thread_count;
+    int stopping;
+    // Circular FIFO, so the oldest (largest) subtrees are picked up first.
+    task *queue;
+    size_t head, count, capacity;
+} Pool = {
+        .once = PTHREAD_ONCE_INIT,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .wake = PTHREAD_COND_INITIALIZER
+};
+
+static _Thread_local int thread_index = 0;
+
+static void
+push_task(task t) {
+    if (Pool.count == Pool.capacity) {
+        size_t capacity = Pool.capacity * 2 + 16;
+        task *queue = malloc(capacity * sizeof(*queue));
+        if (queue == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < Pool.count; i++) {
+            queue[i] = Pool.queue[(Pool.head + i) % Pool.capacity];
+        }
+        free(Pool.queue);
+        Pool.queue = queue;
+        Pool.head = 0;
+        Pool.capacity = capacity;
+    }
+    Pool.queue[(Pool.head + Pool.count) % Pool.capacity] = t;
+    Pool.count++;
+}
+
+/* Remove and return the oldest queued task, or the oldest one belonging to
+ * 'group' if it is not NULL. Returns 0 if there is no such task.
+ */
+static int
+pop_task(task_group *group, task *t) {
+    for (size_t i = 0; i < Pool.count; i++) {
+        size_t pos = (Pool.head + i) % Pool.capacity;
+        if (group != NULL && Pool.queue[pos].group != group) {
+            continue;
+        }
+        *t = Pool.queue[pos];
+        for (size_t j = i; j > 0; j--) {
+            Pool.queue[(Pool.head + j) % Pool.capacity] =
+                    Pool.queue[(Pool.head + j - 1) % Pool.capacity];
+        }
+        Pool.head = (Pool.head + 1) % Pool.capacity;
+        Pool.count--;
+        return 1;
+    }
+    return 0;
+}
+
+static void
+run_task(task t) {
+    pthread_mutex_unlock(&Pool.lock);
+    t.func(t.arg);
+    pthread_mutex_lock(&Pool.lock);
+    if (--t.group->pending == 0) {
+        pthread_cond_broadcast(&Pool.wake);
+    }
+}
+
+static void *
+worker(void *arg) {
+    thread_index = (int)(size_t)arg;
+    pthread_mutex_lock(&Pool.lock);
+    while (!Pool.stopping) {
+        task t;
+        if (pop_task(NULL, &t)) {
+            run_task(t);
+        } else {
+            pthread_cond_wait(&Pool.wake, &Pool.lock);
+        }
+    }
+    pthread_mutex_unlock(&Pool.lock);
+    return NULL;
+}
+
+static void
+start_pool(int threads) {
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0
+                ? (int)cpus
+                : 1;
+    }
+    Pool.thread_count = threads - 1;
+    if (Pool.thread_count == 0) {
+        return;
+    }
+    Pool.threads = malloc(Pool.thread_count * sizeof(*Pool.threads));
+    if (Pool.threads == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < Pool.thread_count; i++) {
+        if (pthread_create(&Pool.threads[i],
+                NULL,
+                worker,
+                (void *)(size_t)(i + 1))) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void
+start_default_pool(void) {
+    start_pool(0);
+}
+
+static int requested_threads, requested_started;
+
+static void
+start_requested_pool(void) {
+    start_pool(requested_threads);
+    requested_started = 1;
+}
+
+int
+pool_init(int threads) {
+    requested_threads = threads;
+    requested_started = 0;
+    pthread_once(&Pool.once, start_requested_pool);
+    return !requested_started;
+}
+
+void
+pool_terminate(void) {
+    pthread_mutex_lock(&Pool.lock);
+    Pool.stopping = 1;
+    pthread_cond_broadcast(&Pool.wake);
+    pthread_mutex_unlock(&Pool.lock);
+    for (int i = 0; i < Pool.thread_count; i++) {
+        pthread_join(Pool.threads[i], NULL);
+    }
+    free(Pool.threads);
+    free(Pool.queue);
+    Pool.threads = NULL;
+    Pool.queue = NULL;
+    Pool.thread_count = 0;
+}
+
+int
+pool_size(void) {
+    pthread_once(&Pool.once, start_default_pool);
+    return Pool.thread_count + 1;
+}
+
+int
+pool_thread_index(void) {
+    return thread_index;
+}
+
+void
+pool_submit(task_group *group, void (*func)(void *), void *arg) {
+    if (pool_size() == 1) {
+        func(arg);
+        return;
+    }
+    pthread_mutex_lock(&Pool.lock);
+    group->pending++;
+    push_task((task){ func, arg, group });
+    pthread_cond_broadcast(&Pool.wake);
+    pthread_mutex_unlock(&Pool.lock);
+}
+
+void
+pool_wait(task_group *group) {
+    pthread_mutex_lock(&Pool.lock);
+    while (group->pending > 0) {
+        task t;
+        if (pop_task(group, &t)) {
+            run_task(t);
+        } else {
+            pthread_cond_wait(&Pool.wake, &Pool.lock);
+        }
+    }
+    pthread_mutex_unlock(&Pool.lock);
+}
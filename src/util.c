@@ -1,6 +1,18 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
 
 char *
 safe_strdup(const char *s) {
@@ -13,3 +25,176 @@ safe_strdup(const char *s) {
     strcpy(ret, s);
     return ret;
 }
+
+long
+wall_clock_ms(void) {
+    struct timespec ts;
+    if (timespec_get(&ts, TIME_UTC) != TIME_UTC) {
+        perror("timespec_get");
+        exit(EXIT_FAILURE);
+    }
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+void *
+map_file(const char *filename, size_t *size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        perror(filename);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror(filename);
+        close(fd);
+        return NULL;
+    }
+    if (st.st_size == 0) {
+        fprintf(stderr, "%s: empty file\n", filename);
+        close(fd);
+        return NULL;
+    }
+    void *data = mmap(NULL,
+            st.st_size,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE,
+            fd,
+            0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror(filename);
+        return NULL;
+    }
+    *size = st.st_size;
+    return data;
+}
+
+void
+unmap_file(void *data, size_t size) {
+    if (munmap(data, size) == -1) {
+        perror("munmap");
+    }
+}
+
+#define HASH_PRIME 0x100000001b3
+
+static void
+hash_block(hash_state *state, const unsigned char *block) {
+    uint64_t words[4];
+    memcpy(words, block, sizeof(words));
+    for (int j = 0; j < 4; j++) {
+        state->lanes[j] = (state->lanes[j] ^ words[j]) * HASH_PRIME;
+    }
+}
+
+void
+hash_init(hash_state *state, uint64_t seed) {
+    *state = (hash_state){
+            {
+                    0xcbf29ce484222325 ^ seed, 0x84222325cbf29ce4 ^ seed,
+                    0x9ce484222325cbf2 ^ seed, 0x2325cbf29ce48422 ^ seed
+            }, { 0 }, 0
+    };
+}
+
+void
+hash_update(hash_state *state, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    size_t i = 0;
+    if (state->pending_len > 0) {
+        for (; i < size && state->pending_len < sizeof(state->pending); i++) {
+            state->pending[state->pending_len++] = bytes[i];
+        }
+        if (state->pending_len < sizeof(state->pending)) {
+            return;
+        }
+        hash_block(state, state->pending);
+        state->pending_len = 0;
+    }
+    for (; i + sizeof(state->pending) <= size; i += sizeof(state->pending)) {
+        hash_block(state, bytes + i);
+    }
+    memcpy(state->pending, bytes + i, size - i);
+    state->pending_len = size - i;
+}
+
+uint64_t
+hash_final(const hash_state *state) {
+    uint64_t lanes[4];
+    memcpy(lanes, state->lanes, sizeof(lanes));
+    for (size_t i = 0; i < state->pending_len; i++) {
+        lanes[0] = (lanes[0] ^ state->pending[i]) * HASH_PRIME;
+    }
+    return ((lanes[0] * HASH_PRIME ^ lanes[1]) * HASH_PRIME ^ lanes[2]) *
+            HASH_PRIME ^ lanes[3];
+}
+
+uint64_t
+hash_data(const void *data, size_t size, uint64_t seed) {
+    hash_state state;
+    hash_init(&state, seed);
+    hash_update(&state, data, size);
+    return hash_final(&state);
+}
+
+long
+peak_rss_mb(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == -1) {
+        perror("getrusage");
+        return -1;
+    }
+    // Linux reports kilobytes.
+    return usage.ru_maxrss / 1024;
+}
+
+int
+make_directory(const char *path) {
+    if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+        perror(path);
+        return 1;
+    }
+    return 0;
+}
+
+FILE *
+create_temp_file(const char *path, char **temp_path) {
+    size_t size = snprintf(NULL, 0, "%s.XXXXXX", path);
+    *temp_path = malloc(size + 1);
+    if (*temp_path == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(*temp_path, "%s.XXXXXX", path);
+    int fd = mkstemp(*temp_path);
+    if (fd == -1) {
+        perror(*temp_path);
+        free(*temp_path);
+        *temp_path = NULL;
+        return NULL;
+    }
+    FILE *file = fdopen(fd, "wb");
+    if (file == NULL) {
+        perror(*temp_path);
+        close(fd);
+        remove(*temp_path);
+        free(*temp_path);
+        *temp_path = NULL;
+    }
+    return file;
+}
+
+int
+publish_file(FILE *file, const char *temp_path, const char *path) {
+    // Flush to disk before the rename, so a crash can't publish a file
+    // whose contents were never written.
+    int failed = fflush(file) != 0 || ferror(file) ||
+            fsync(fileno(file)) == -1;
+    failed |= fclose(file) != 0;
+    if (failed || rename(temp_path, path) == -1) {
+        perror(path);
+        remove(temp_path);
+        return 1;
+    }
+    return 0;
+}
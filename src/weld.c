@@ -0,0 +1,216 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kd_tree.h"
+#include "list.h"
+#include "weld.h"
+
+/* Open-addressed hash table from keys of three integers to an int, with
+ * 'value' -1 marking an empty slot.
+ */
+typedef struct weld_slot {
+    int64_t key[3];
+    int value;
+} weld_slot;
+
+typedef struct weld_table {
+    weld_slot *slots;
+    size_t mask;
+} weld_table;
+
+/* A table that can hold 'count' keys while staying at most half full. */
+static weld_table
+new_table(size_t count) {
+    size_t capacity = 16;
+    while (capacity < 2 * count) {
+        capacity *= 2;
+    }
+    weld_table table = {
+            malloc(capacity * sizeof(*table.slots)), capacity - 1
+    };
+    if (table.slots == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        table.slots[i].value = -1;
+    }
+    return table;
+}
+
+static size_t
+hash_key(const int64_t key[3]) {
+    uint64_t h = 0;
+    for (int i = 0; i < 3; i++) {
+        h = (h ^ (uint64_t)key[i]) * 0x9E3779B97F4A7C15u;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+/* The slot holding 'key', or the empty slot where it belongs. */
+static weld_slot *
+find_slot(const weld_table *table, const int64_t key[3]) {
+    size_t i = hash_key(key) & table->mask;
+    while (table->slots[i].value != -1 &&
+            memcmp(table->slots[i].key, key, sizeof(table->slots[i].key))) {
+        i = (i + 1) & table->mask;
+    }
+    return &table->slots[i];
+}
+
+/* Key of the grid cell of side 'tolerance' holding 'v', or of the exact
+ * bits of 'v' if there is no tolerance. Returns 1 if the neighbouring
+ * cells must be searched too, or 0 if there is no tolerance or 'v' has a
+ * coordinate too large or not finite to have a cell, whose key is then
+ * INT64_MAX.
+ */
+static int
+cell_key(Vector3 v, vec_t tolerance, int64_t key[3]) {
+    int in_grid = tolerance > 0;
+    for (int i = 0; i < 3; i++) {
+        if (tolerance > 0) {
+            double cell = floor(v.s[i] / tolerance);
+            if (isfinite(cell) && fabs(cell) < 0x1p62) {
+                key[i] = (int64_t)cell;
+            } else {
+                key[i] = INT64_MAX;
+                in_grid = 0;
+            }
+        } else {
+            // Adding zero folds -0 into +0.
+            vec_t value = v.s[i] + 0.0f;
+            uint32_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            key[i] = bits;
+        }
+    }
+    return in_grid;
+}
+
+static int
+within(Vector3 a, Vector3 b, vec_t tolerance) {
+    return tolerance <= 0 ||
+            vec_length_squared(vec_subtract(a, b)) <= tolerance * tolerance;
+}
+
+/* Map every vector to the first one within 'tolerance' of it. Vectors are
+ * compared against the earlier ones chained in their own and neighbouring
+ * cells, so a weld never reaches further than 'tolerance'.
+ */
+static int *
+weld_vectors(const Vector3 *vecs, vec_t tolerance) {
+    size_t count = vector_length(vecs);
+    int *ids = malloc(count * sizeof(*ids));
+    int *next = malloc(count * sizeof(*next));
+    if (ids == NULL || next == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    weld_table cells = new_table(count);
+    for (size_t i = 0; i < count; i++) {
+        int64_t key[3];
+        int reach = cell_key(vecs[i], tolerance, key);
+        int match = -1;
+        for (int dz = -reach; dz <= reach && match == -1; dz++) {
+            for (int dy = -reach; dy <= reach && match == -1; dy++) {
+                for (int dx = -reach; dx <= reach && match == -1; dx++) {
+                    int64_t near[3] = {
+                            key[0] + dx, key[1] + dy, key[2] + dz
+                    };
+                    for (int j = find_slot(&cells, near)->value;
+                            j != -1 && match == -1;
+                            j = next[j]) {
+                        if (within(vecs[i], vecs[j], tolerance)) {
+                            match = j;
+                        }
+                    }
+                }
+            }
+        }
+        if (match == -1) {
+            weld_slot *slot = find_slot(&cells, key);
+            memcpy(slot->key, key, sizeof(slot->key));
+            next[i] = slot->value;
+            slot->value = (int)i;
+            match = (int)i;
+        }
+        ids[i] = match;
+    }
+    free(cells.slots);
+    free(next);
+    return ids;
+}
+
+cl_int4 *
+weld_mesh(cl_int3 *corners,
+        Vector3 **verts,
+        Vector3 **norms,
+        int **sources,
+        vec_t tolerance) {
+    size_t face_count = vector_length(corners) / 3;
+    int *pos_ids = weld_vectors(*verts, tolerance);
+    int *norm_ids = weld_vectors(*norms, 0);
+    int has_norms = vector_length(*norms) > 0;
+    weld_table vertices = new_table(3 * face_count);
+    Vector3 *out_verts = new_list(0), *out_norms = new_list(0);
+    int *out_sources = new_list(0);
+    cl_int4 *out = new_list(face_count * sizeof(*out));
+    size_t degenerate = 0;
+    for (size_t i = 0; i < face_count; i++) {
+        int pos[3], norm[3];
+        for (int k = 0; k < 3; k++) {
+            cl_int3 corner = corners[3 * i + k];
+            pos[k] = pos_ids[corner.s[0]];
+            norm[k] = corner.s[1] >= 0
+                    ? norm_ids[corner.s[1]]
+                    : -1;
+        }
+        if (pos[0] == pos[1] || pos[1] == pos[2] || pos[2] == pos[0]) {
+            degenerate++;
+            continue;
+        }
+        cl_int4 tri = {
+                { 0, 0, 0, KD_TRI_SMOOTH }
+        };
+        for (int k = 0; k < 3; k++) {
+            int64_t key[3] = { pos[k], norm[k], 0 };
+            weld_slot *slot = find_slot(&vertices, key);
+            if (slot->value == -1) {
+                memcpy(slot->key, key, sizeof(slot->key));
+                slot->value = (int)vector_length(out_verts);
+                vector_append(out_verts, (*verts)[pos[k]]);
+                vector_append(out_sources, pos[k]);
+                if (has_norms) {
+                    vector_append(out_norms, norm[k] >= 0
+                            ? (*norms)[norm[k]]
+                            : Vector3_zero);
+                }
+            }
+            tri.s[k] = slot->value;
+            if (norm[k] == -1) {
+                tri.s[3] &= ~KD_TRI_SMOOTH;
+            }
+        }
+        vector_append(out, tri);
+    }
+    printf("Welded %zu positions and %zu normals into %zu vertices, "
+           "removing %zu degenerate triangles\n",
+            vector_length(*verts),
+            vector_length(*norms),
+            vector_length(out_verts),
+            degenerate);
+    free(vertices.slots);
+    free(pos_ids);
+    free(norm_ids);
+    delete_list(corners);
+    delete_list(*verts);
+    delete_list(*norms);
+    *verts = out_verts;
+    *norms = out_norms;
+    *sources = out_sources;
+    return out;
+}